@@ -0,0 +1,395 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "octree.h"
+#include "kdtree.h"
+#include "kdflat.h"
+#include "lattice.h"
+#include "naive.h"
+#include "image.h"
+#include "grow.h"
+#include "rand.h"
+#include "colorset.h"
+#include "scan.h"
+
+enum op_type { OP_ADD, OP_REMOVE, OP_NEAREST };
+
+static const char *op_names[] = {"add", "remove", "nearest"};
+
+typedef struct op {
+    enum op_type type;
+    float dist;
+    uint32_t x, y;  /* position of the nearest edge */
+    edge edge;
+} op;
+
+/* A finder that logs every operation before passing it along. */
+typedef struct recorder {
+    finder finder;
+    finder *inner;
+    op *ops;
+    size_t count, max;
+    size_t frontier, peak;
+    uint32_t width, height;  /* of the recorded image */
+} recorder;
+
+static op *
+recorder_push(recorder *r, enum op_type type, edge e)
+{
+    if (r->count == r->max) {
+        r->max *= 2;
+        r->ops = realloc(r->ops, r->max * sizeof(r->ops[0]));
+    }
+    op *o = r->ops + r->count++;
+    o->type = type;
+    o->dist = 0;
+    o->edge = e;
+    return o;
+}
+
+static bool
+recorder_add(finder *f, edge e)
+{
+    recorder *r = (recorder *)f;
+    recorder_push(r, OP_ADD, e);
+    if (++r->frontier > r->peak)
+        r->peak = r->frontier;
+    return finder_add(r->inner, e);
+}
+
+static bool
+recorder_remove(finder *f, edge e)
+{
+    recorder *r = (recorder *)f;
+    recorder_push(r, OP_REMOVE, e);
+    r->frontier--;
+    return finder_remove(r->inner, e);
+}
+
+static float
+recorder_nearest(const finder *f, color c, edge *e)
+{
+    recorder *r = (recorder *)f;
+    op *o = recorder_push(r, OP_NEAREST, (edge){0, 0, c});
+    o->dist = finder_nearest(r->inner, c, e);
+    o->x = e->x;
+    o->y = e->y;
+    return o->dist;
+}
+
+/* Logged as a nearest lookup of its first answer. */
+static void
+recorder_nearest_k(const finder *f, color c, nearest_set *set)
+{
+    recorder *r = (recorder *)f;
+    op *o = recorder_push(r, OP_NEAREST, (edge){0, 0, c});
+    r->inner->nearest_k(r->inner, c, set);
+    o->dist = set->count ? sqrtf(set->dist2[0]) : INFINITY;
+    o->x = set->count ? set->edges[0].x : 0;
+    o->y = set->count ? set->edges[0].y : 0;
+}
+
+static void
+recorder_free(const finder *f)
+{
+    recorder *r = (recorder *)f;
+    finder_free(r->inner);
+    free(r->ops);
+}
+
+static void
+recorder_init(recorder *r, finder *inner)
+{
+    r->finder.add = recorder_add;
+    r->finder.remove = recorder_remove;
+    r->finder.nearest = recorder_nearest;
+    r->finder.nearest_from = NULL;
+    r->finder.nearest_k = recorder_nearest_k;
+    r->finder.free = recorder_free;
+    r->finder.slack = 1.0f;
+    r->inner = inner;
+    r->max = 4096;
+    r->count = 0;
+    r->ops = malloc(r->max * sizeof(r->ops[0]));
+    r->frontier = r->peak = 0;
+}
+
+/* The lattice is shaped by the colorset, the rest by the image. */
+#define BENCH_CREATE(name) \
+    static finder * \
+    name##_bench(uint32_t width, uint32_t height, int depth, float gamma) \
+    { \
+        (void)depth; \
+        (void)gamma; \
+        return name##_create(width, height); \
+    }
+BENCH_CREATE(naive)
+BENCH_CREATE(octree)
+BENCH_CREATE(kdtree)
+BENCH_CREATE(kdflat)
+
+static finder *
+lattice_bench(uint32_t width, uint32_t height, int depth, float gamma)
+{
+    (void)width;
+    (void)height;
+    return lattice_create(depth, gamma);
+}
+
+static const struct backend {
+    char name;
+    const char *long_name;
+    finder *(*create)(uint32_t width, uint32_t height,
+                      int depth, float gamma);
+    kdtree_shape (*measure)(const finder *);
+} backends[] = {
+    {'N', "naive",   naive_bench,    0},
+    {'O', "octree",  octree_bench,   0},
+    {'K', "kdtree",  kdtree_bench,   kdtree_measure},
+    {'F', "kdflat",  kdflat_bench,   0},
+    {'L', "lattice", lattice_bench,  0},
+};
+
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Estimate the cost of a single now() call so it can be subtracted. */
+static uint64_t
+timer_overhead(void)
+{
+    long n = 1 << 16;
+    uint64_t start = now();
+    for (long i = 0; i < n; i++)
+        now();
+    return (now() - start) / n;
+}
+
+/* Record the op stream of a complete image, truncated to limit ops. */
+static void
+record(recorder *r, int depth, float gamma, uint64_t seed, size_t limit)
+{
+    uint32_t width = UINT32_C(1) << ((3 * depth + 1) / 2);
+    uint32_t height = UINT32_C(1) << (3 * depth / 2);
+    image *image = image_create(width, height, depth, gamma);
+    colorset *colorset = colorset_create(depth, gamma);
+    rng shuffle = rng_stream(seed, RNG_SHUFFLE);
+    rng place = rng_stream(seed, RNG_PLACE);
+    colorset_shuffle(colorset, &shuffle);
+
+    /* The octree is exact, so its answers serve as the reference. */
+    recorder_init(r, octree_create(width, height));
+    r->width = width;
+    r->height = height;
+    grow grow;
+    grow_init(&grow, image, colorset, &r->finder, &place);
+    grow_start(&grow, width / 2, height / 2);
+    while (!grow_done(&grow) && (limit == 0 || r->count < limit))
+        grow_step(&grow);
+    if (limit && r->count > limit)
+        r->count = limit;
+
+    colorset_free(colorset);
+    image_free(image);
+}
+
+/* With epsilon above 0, a lookup only mismatches if it breaks the
+ * 1 + epsilon bound, and the ratio of each returned distance to the
+ * true nearest one is reported. This is what epsilon gives up.
+ */
+static size_t
+replay(const struct backend *b, const recorder *r,
+       int depth, float gamma, float epsilon, uint64_t overhead)
+{
+    uint64_t times[3] = {0, 0, 0};
+    size_t counts[3] = {0, 0, 0};
+    size_t mismatches = 0;
+    double ratios = 0, worst_ratio = 1;
+    size_t nratios = 0;
+    kdtree_shape worst = {0, 0, 0};
+    finder *f = b->create(r->width, r->height, depth, gamma);
+    finder_approximate(f, epsilon);
+    uint64_t start = now();
+    for (size_t i = 0; i < r->count; i++) {
+        const op *o = r->ops + i;
+        uint64_t t0 = now();
+        switch (o->type) {
+            case OP_ADD:
+                finder_add(f, o->edge);
+                break;
+            case OP_REMOVE:
+                finder_remove(f, o->edge);
+                break;
+            case OP_NEAREST: {
+                edge e;
+                float dist = finder_nearest(f, o->edge.color, &e);
+                if (epsilon > 0) {
+                    /* Slack on squared distances rounds a little. */
+                    if (dist > o->dist * (1 + epsilon) * (1 + 1e-6))
+                        mismatches++;
+                    if (o->dist > 0) {
+                        double ratio = dist / o->dist;
+                        ratios += ratio;
+                        nratios++;
+                        if (ratio > worst_ratio)
+                            worst_ratio = ratio;
+                    }
+                } else if (dist != o->dist || e.x != o->x || e.y != o->y) {
+                    /* Ties are broken by position, so the edge must
+                     * match.
+                     */
+                    mismatches++;
+                }
+            } break;
+        }
+        times[o->type] += now() - t0;
+        counts[o->type]++;
+        if (b->measure && i % 65536 == 0) {
+            kdtree_shape shape = b->measure(f);
+            if (shape.depth > worst.depth)
+                worst.depth = shape.depth;
+            if (shape.empty > worst.empty)
+                worst.empty = shape.empty;
+        }
+    }
+    uint64_t total = now() - start;
+
+    printf("  %-8s", b->long_name);
+    for (int t = 0; t < 3; t++) {
+        double ns = 0;
+        if (counts[t])
+            ns = (double)times[t] / counts[t] - overhead;
+        printf(" %10.1f", ns < 0 ? 0 : ns);
+    }
+    printf(" %10.1f %10zu\n", total / 1e6, mismatches);
+    if (epsilon > 0)
+        printf("  %-8s distance ratio mean %.6f, max %.4f\n", "",
+               nratios ? ratios / nratios : 1.0, worst_ratio);
+    if (b->measure) {
+        /* Samples are sparse, so the final shape may be the worst. */
+        kdtree_shape shape = b->measure(f);
+        if (shape.depth > worst.depth)
+            worst.depth = shape.depth;
+        if (shape.empty > worst.empty)
+            worst.empty = shape.empty;
+        printf("  %-8s depth %d (max %d), %ld leaves, %ld empty (max %ld)\n",
+               "", shape.depth, worst.depth, shape.leaves, shape.empty,
+               worst.empty);
+    }
+    finder_free(f);
+    return mismatches;
+}
+
+static void
+print_usage(const char *name, FILE *o)
+{
+    fprintf(o, "Usage: %s [options]\n", name);
+    fprintf(o, "  -d <list>     comma-separated depths (6,7,8)\n");
+    fprintf(o, "  -b <list>     backends to race, any of NOKFL (NOKFL)\n");
+    fprintf(o, "  -n <ops>      ops replayed per depth, 0 for all (%d)\n",
+            1 << 20);
+    fprintf(o, "  -k <kernel>   force avx512, avx2, sse2 or scalar scan\n");
+    fprintf(o, "  -S <seed>     op stream random seed (1)\n");
+    fprintf(o, "  -g <gamma>    select gamma (2.2)\n");
+    fprintf(o, "  -e <epsilon>  replay approximate lookups (0)\n");
+    fprintf(o, "  -h            print this help\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    /* Options */
+    const char *depths = "6,7,8";
+    const char *select = "NOKFL";
+    size_t limit = 1 << 20;
+    uint64_t seed = 1;
+    float gamma = 2.2f;
+    float epsilon = 0.0f;
+
+    int option;
+    while ((option = getopt(argc, argv, "d:b:n:k:S:g:e:h")) != -1) {
+        switch (option) {
+            case 'd':
+                depths = optarg;
+                break;
+            case 'b':
+                select = optarg;
+                break;
+            case 'n':
+                limit = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                if (!scan_select(optarg)) {
+                    fprintf(stderr, "%s: unsupported kernel, %s\n",
+                            argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 16);
+                break;
+            case 'g':
+                gamma = strtof(optarg, NULL);
+                break;
+            case 'e':
+                epsilon = strtof(optarg, NULL);
+                break;
+            case 'h':
+                print_usage(argv[0], stdout);
+                exit(EXIT_SUCCESS);
+                break;
+            default:
+                print_usage(argv[0], stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t overhead = timer_overhead();
+    printf("leaf scan kernel: %s\n", scan_kernel());
+    bool failed = false;
+    for (const char *p = depths; *p; ) {
+        char *end;
+        int depth = strtol(p, &end, 10);
+        if (end == p || depth < 1 || depth > 8) {
+            fprintf(stderr, "%s: invalid depth list, %s\n", argv[0], depths);
+            exit(EXIT_FAILURE);
+        }
+        p = *end == ',' ? end + 1 : end;
+
+        recorder r;
+        record(&r, depth, gamma, seed, limit);
+        size_t counts[3] = {0, 0, 0};
+        for (size_t i = 0; i < r.count; i++)
+            counts[r.ops[i].type]++;
+        printf("depth %d: %zu ops (", depth, r.count);
+        for (int t = 0; t < 3; t++)
+            printf("%s%zu %s", t ? ", " : "", counts[t], op_names[t]);
+        printf("), peak frontier %zu edges\n", r.peak);
+        printf("  %-8s %10s %10s %10s %10s %10s\n", "backend",
+               "add ns", "remove ns", "nearest ns", "total ms", "mismatch");
+
+        for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+            if (strchr(select, backends[i].name)) {
+                size_t mismatches = replay(backends + i, &r, depth, gamma,
+                                           epsilon, overhead);
+                fflush(stdout);
+                if (mismatches) {
+                    fprintf(stderr, "%s: %s disagrees with the reference "
+                            "nearest edge at depth %d\n",
+                            argv[0], backends[i].long_name, depth);
+                    failed = true;
+                }
+            }
+        }
+        finder_free(&r.finder);
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
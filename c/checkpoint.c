@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "checkpoint.h"
+
+/* The file is this header followed by the packed pixel levels, the
+ * padded occupancy bitmap, the packed indices of the remaining colors in pop
+ * order (unless the colorset is lazy) and the frontier edges, in native
+ * byte order.
+ */
+struct checkpoint_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t depth;
+    float gamma;
+    uint32_t lazy;
+    uint64_t keys[COLORSET_ROUNDS];
+    uint64_t rng[4];
+    uint64_t pixels_left;
+    uint64_t colors;
+    uint64_t frontier;
+};
+
+#define CHECKPOINT_MAGIC   "RGBC"
+#define CHECKPOINT_VERSION 6
+
+bool
+checkpoint_save(const char *path, const grow *g, float gamma)
+{
+    const image *im = g->image;
+    size_t pixels = (size_t)im->width * im->height;
+    size_t bits = image_occupied_size(im);
+    size_t count = 0;
+    size_t max = 4096;
+    edge *frontier = malloc(max * sizeof(frontier[0]));
+    for (uint32_t y = 0; y < im->height; y++) {
+        for (uint32_t x = 0; x < im->width; x++) {
+            if (image_frontier(im, x, y)) {
+                if (count == max) {
+                    max *= 2;
+                    frontier = realloc(frontier, max * sizeof(frontier[0]));
+                }
+                frontier[count++] = (edge){x, y, image_get(im, x, y)};
+            }
+        }
+    }
+
+    struct checkpoint_header header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .width = im->width,
+        .height = im->height,
+        .depth = g->colorset->depth,
+        .gamma = gamma,
+        .lazy = g->colorset->lazy,
+        .pixels_left = g->pixels_left,
+        .colors = g->colorset->count,
+        .frontier = count,
+    };
+    memcpy(header.keys, g->colorset->keys, sizeof(header.keys));
+    memcpy(header.rng, g->rng.s, sizeof(header.rng));
+    assert(g->colorset->offset == 0);
+    size_t stored = header.lazy ? 0 : header.colors;
+
+    /* Write beside the target and rename, so a crash never leaves a
+     * torn checkpoint behind.
+     */
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    bool ok = f != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(im->levels, sizeof(im->levels[0]),
+                    pixels, f) == pixels &&
+             fwrite(im->occupied, 1, bits, f) == bits &&
+             fwrite(g->colorset->indices, sizeof(uint32_t),
+                    stored, f) == stored &&
+             fwrite(frontier, sizeof(frontier[0]), count, f) == count;
+        ok = !fclose(f) && ok && !rename(tmp, path);
+        if (!ok)
+            remove(tmp);
+    }
+    free(tmp);
+    free(frontier);
+    return ok;
+}
+
+bool
+checkpoint_load(const char *path, checkpoint *cp)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, 4) != 0 ||
+        header.version != CHECKPOINT_VERSION ||
+        header.width == 0 || header.height == 0 ||
+        header.depth < 1 || header.depth > COLORSET_MAX_DEPTH ||
+        header.colors > (uint64_t)1 << (3 * header.depth) ||
+        header.pixels_left > (uint64_t)header.width * header.height ||
+        header.frontier > (uint64_t)header.width * header.height) {
+        fclose(f);
+        return false;
+    }
+
+    cp->gamma = header.gamma;
+    memcpy(cp->rng.s, header.rng, sizeof(header.rng));
+    cp->pixels_left = header.pixels_left;
+    cp->count = header.frontier;
+    cp->image = image_create(header.width, header.height,
+                             header.depth, header.gamma);
+    if (header.lazy) {
+        rng unused = rng_stream(0, RNG_SHUFFLE);
+        cp->colorset = colorset_create_lazy(header.depth, header.gamma,
+                                            &unused);
+        memcpy(cp->colorset->keys, header.keys, sizeof(header.keys));
+    } else {
+        cp->colorset = colorset_create(header.depth, header.gamma);
+    }
+    cp->colorset->count = header.colors;
+    size_t stored = header.lazy ? 0 : header.colors;
+    cp->frontier = malloc(cp->count * sizeof(cp->frontier[0]));
+    if (cp->count && !cp->frontier) {
+        fclose(f);
+        image_free(cp->image);
+        colorset_free(cp->colorset);
+        return false;
+    }
+
+    image *im = cp->image;
+    size_t pixels = (size_t)im->width * im->height;
+    size_t bits = image_occupied_size(im);
+    bool ok = fread(im->levels, sizeof(im->levels[0]),
+                    pixels, f) == pixels &&
+              fread(im->occupied, 1, bits, f) == bits &&
+              fread(cp->colorset->indices, sizeof(uint32_t),
+                    stored, f) == stored &&
+              fread(cp->frontier, sizeof(cp->frontier[0]),
+                    cp->count, f) == cp->count;
+    fclose(f);
+
+    /* The finder trusts its edges, so each must be a placed pixel with
+     * that pixel's color.
+     */
+    uint32_t limit = UINT32_C(1) << (3 * im->depth);
+    for (size_t i = 0; ok && i < cp->count; i++) {
+        edge e = cp->frontier[i];
+        ok = e.x < im->width && e.y < im->height &&
+             image_occupied(im, e.x, e.y) &&
+             im->levels[(size_t)e.y * im->width + e.x] < limit;
+        if (ok) {
+            color c = image_get(im, e.x, e.y);
+            ok = c.p.r == e.color.p.r && c.p.g == e.color.p.g &&
+                 c.p.b == e.color.p.b;
+        }
+    }
+    if (!ok) {
+        image_free(cp->image);
+        colorset_free(cp->colorset);
+        free(cp->frontier);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include "grow.h"
+
+/* Everything needed to pick a render back up where it left off. The
+ * frontier is every placed pixel that still has a free neighbor. Edges
+ * the finder has yet to discard lazily can never be chosen, so the
+ * resumed render places exactly the same pixels.
+ */
+typedef struct checkpoint {
+    float gamma;
+    image *image;
+    colorset *colorset;
+    rng rng;
+    size_t pixels_left;
+    size_t count;
+    edge *frontier;
+} checkpoint;
+
+/* Atomically replace path with a snapshot of g. */
+bool checkpoint_save(const char *path, const grow *g, float gamma);
+
+/* Read a snapshot into cp, which then owns a new image and colorset. */
+bool checkpoint_load(const char *path, checkpoint *cp);
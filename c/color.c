@@ -5,13 +5,91 @@
 
 #include "octree.h"
 #include "kdtree.h"
+#include "kdflat.h"
+#include "lattice.h"
 #include "naive.h"
 #include "image.h"
+#include "grow.h"
 #include "rand.h"
 #include "color.h"
 #include "colorset.h"
+#include "checkpoint.h"
+#include "tile.h"
+#include "stats.h"
 
-enum method { METHOD_NAIVE, METHOD_OCTREE, METHOD_KDTREE };
+enum long_option {
+    OPT_CHECKPOINT = 256, OPT_EVERY, OPT_RESUME, OPT_STATS, OPT_ORDER
+};
+
+static const char *const order_names[] = {
+    [COLORSET_RANDOM]  = "random",
+    [COLORSET_SORTED]  = "sorted",
+    [COLORSET_MORTON]  = "morton",
+    [COLORSET_HILBERT] = "hilbert",
+    [COLORSET_BLOCKED] = "blocked",
+};
+
+/* Colors between --stats samples. */
+#define STATS_PERIOD (1 << 16)
+
+enum method {
+    METHOD_NAIVE   = FINDER_NAIVE,
+    METHOD_OCTREE  = FINDER_OCTREE,
+    METHOD_KDTREE  = FINDER_KDTREE,
+    METHOD_KDFLAT  = FINDER_KDFLAT,
+    METHOD_LATTICE = FINDER_LATTICE
+};
+
+/* A build bound to one backend defaults to it and accepts no other. */
+#ifdef FINDER_STATIC
+#  define METHOD_DEFAULT FINDER_STATIC
+#else
+#  define METHOD_DEFAULT METHOD_KDTREE
+#endif
+
+struct finder_options {
+    enum method method;
+    int depth;
+    float gamma;
+    float epsilon;
+};
+
+static finder *
+create_finder(void *ctx, uint32_t width, uint32_t height)
+{
+    const struct finder_options *o = ctx;
+    finder *finder = NULL;
+    switch (o->method) {
+        case METHOD_NAIVE:
+            finder = naive_create(width, height);
+            break;
+        case METHOD_OCTREE:
+            finder = octree_create(width, height);
+            break;
+        case METHOD_KDTREE:
+            finder = kdtree_create(width, height);
+            break;
+        case METHOD_KDFLAT:
+            finder = kdflat_create(width, height);
+            break;
+        case METHOD_LATTICE:
+            finder = lattice_create(o->depth, o->gamma);
+            break;
+    }
+    finder_approximate(finder, o->epsilon);
+    return finder;
+}
+
+static void
+write_frame(grow *g, FILE *output)
+{
+    STATS_START();
+    if (g->delta)
+        delta_frame(g->delta);
+    else
+        image_save(g->image, output);
+    STATS_STOP(STAT_FRAME, 1);
+}
 
 static void
 print_usage(const char *name, FILE *o)
@@ -21,12 +99,29 @@ print_usage(const char *name, FILE *o)
     fprintf(o, "  -s <w:h:d>    image width (512x512x6)\n");
     fprintf(o, "  -S <seed>     select a specific random seed\n");
     fprintf(o, "  -n            steps between video frames (0)\n");
+    fprintf(o, "  -D            write frames as a delta stream (undelta),\n");
+    fprintf(o, "                depth 8 or less\n");
     fprintf(o, "  -p <x,y>      add a start point, may be repeated\n");
     fprintf(o, "  -N            use naive color matcher\n");
     fprintf(o, "  -O            use octree color matcher\n");
     fprintf(o, "  -K            use kdtree color matcher (default)\n");
+    fprintf(o, "  -F            use flat kdtree color matcher\n");
+    fprintf(o, "  -L            use lattice bitmap color matcher\n");
     fprintf(o, "  -g <gamma>    select gamma (2.2)\n");
-    fprintf(o, "  -v            verbose\n");
+    fprintf(o, "  -l            generate the color order lazily\n");
+    fprintf(o, "  --order <o>   random, sorted, morton, hilbert, blocked\n");
+    fprintf(o, "  -j <n>        speculative lookups on n threads (off)\n");
+    fprintf(o, "  -P            prune surrounded edges eagerly\n");
+    fprintf(o, "  -e <epsilon>  accept matches within 1+epsilon of nearest\n");
+    fprintf(o, "                (not with -j)\n");
+    fprintf(o, "  -t <c:r>      grow a grid of tiles on -j threads\n");
+    fprintf(o, "                (not with -n)\n");
+    fprintf(o, "  --checkpoint <file>  save progress to file periodically\n");
+    fprintf(o, "  --every <n>          colors between checkpoints (%d)\n",
+            1 << 20);
+    fprintf(o, "  --resume <file>      continue from a checkpoint\n");
+    fprintf(o, "  --stats <file>       write JSON samples of progress\n");
+    fprintf(o, "  -v            verbose, twice for a final stats sample\n");
     fprintf(o, "  -h            print this help\n");
 }
 
@@ -39,17 +134,39 @@ main(int argc, char **argv)
     uint32_t width = 512;
     uint32_t height = 512;
     int depth = 6;
-    enum method method = METHOD_KDTREE;
-    bool verbose = false;
+    enum method method = METHOD_DEFAULT;
+    int verbose = 0;
+    FILE *stats = NULL;
     int steps = 0;
     int nstarts = 0;
     float gamma = 2.2f;
+    int threads = 0;
+    bool deltas = false;
+    bool prune = false;
+    bool lazy = false;
+    enum colorset_order order = COLORSET_RANDOM;
+    int cols = 0;
+    int rows = 0;
+    float epsilon = 0.0f;
+    const char *checkpoint_file = NULL;
+    const char *resume_file = NULL;
+    size_t every = 1 << 20;
     struct {
         uint32_t x, y;
     } starts[128];
 
+    static const struct option long_options[] = {
+        {"checkpoint", required_argument, 0, OPT_CHECKPOINT},
+        {"every",      required_argument, 0, OPT_EVERY},
+        {"resume",     required_argument, 0, OPT_RESUME},
+        {"stats",      required_argument, 0, OPT_STATS},
+        {"order",      required_argument, 0, OPT_ORDER},
+        {0, 0, 0, 0}
+    };
+    const char *short_options = "o:s:S:n:p:g:j:e:t:lDPNOKFLhv";
     int option;
-    while ((option = getopt(argc, argv, "o:s:S:n:p:g:NOKhv")) != -1) {
+    while ((option = getopt_long(argc, argv, short_options,
+                                 long_options, NULL)) != -1) {
         switch (option) {
             case 'o':
                 if (strcmp(optarg, "-") != 0) {
@@ -81,6 +198,26 @@ main(int argc, char **argv)
             case 'g':
                 gamma = strtof(optarg, NULL);
                 break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'e':
+                epsilon = strtof(optarg, NULL);
+                break;
+            case 't': {
+                char *p = optarg;
+                cols = strtol(p, &p, 10);
+                rows = *p ? strtol(p + 1, &p, 10) : cols;
+            } break;
+            case 'l':
+                lazy = true;
+                break;
+            case 'D':
+                deltas = true;
+                break;
+            case 'P':
+                prune = true;
+                break;
             case 'N':
                 method = METHOD_NAIVE;
                 break;
@@ -90,8 +227,46 @@ main(int argc, char **argv)
             case 'K':
                 method = METHOD_KDTREE;
                 break;
+            case 'F':
+                method = METHOD_KDFLAT;
+                break;
+            case 'L':
+                method = METHOD_LATTICE;
+                break;
+            case OPT_CHECKPOINT:
+                checkpoint_file = optarg;
+                break;
+            case OPT_EVERY:
+                every = strtoull(optarg, NULL, 10);
+                if (every == 0) {
+                    fprintf(stderr, "%s: invalid --every, %s\n",
+                            argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_STATS:
+                stats = fopen(optarg, "w");
+                if (stats == NULL) {
+                    perror(optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ORDER: {
+                int n = sizeof(order_names) / sizeof(order_names[0]);
+                int i = 0;
+                while (i < n && strcmp(optarg, order_names[i]))
+                    i++;
+                if (i == n) {
+                    fprintf(stderr, "%s: unknown order %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                order = i;
+            } break;
+            case OPT_RESUME:
+                resume_file = optarg;
+                break;
             case 'v':
-                verbose = true;
+                verbose++;
                 break;
             case 'h':
                 print_usage(argv[0], stdout);
@@ -102,72 +277,194 @@ main(int argc, char **argv)
                 exit(EXIT_FAILURE);
         }
     }
+#ifdef FINDER_STATIC
+    if (method != METHOD_DEFAULT) {
+        fprintf(stderr, "%s: built for a single color matcher\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if (!resume_file && (width == 0 || height == 0 ||
+                         depth < 1 || depth > COLORSET_MAX_DEPTH)) {
+        fprintf(stderr, "%s: -s needs a nonzero size and a depth of 1 to "
+                "%d\n", argv[0], COLORSET_MAX_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+    if ((cols > 0 || rows > 0) && !resume_file &&
+        !tile_fits(cols, rows, width, height)) {
+        fprintf(stderr, "%s: -t %d:%d leaves tiles under 2 pixels\n",
+                argv[0], cols, rows);
+        exit(EXIT_FAILURE);
+    }
+    /* Tiles grow apart on their own images, so there is no canvas to
+     * take frames of until every tile is done.
+     */
+    if ((cols > 0 || rows > 0) && steps > 0 && !resume_file) {
+        fprintf(stderr, "%s: -t cannot be combined with -n\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* Speculative answers are rechecked exactly, but an approximate
+     * answer depends on the search that found it, so the image would
+     * depend on the thread count.
+     */
+    if (epsilon > 0 && threads > 0) {
+        fprintf(stderr, "%s: -e cannot be combined with -j\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (lazy && order != COLORSET_RANDOM) {
+        fprintf(stderr, "%s: -l only supports random order\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
     if (seed == 0)
         seed = seedgen();
+    stats_seconds();  /* start the clock */
 
-    finder *finder;
-    switch (method) {
-        case METHOD_NAIVE:
-            finder = naive_create();
-            break;
-        case METHOD_OCTREE:
-            finder = octree_create();
-            break;
-        case METHOD_KDTREE:
-            finder = kdtree_create();
-            break;
+    /* A checkpoint decides the image shape and palette. */
+    checkpoint resume = {0};
+    if (resume_file) {
+        if (!checkpoint_load(resume_file, &resume)) {
+            fprintf(stderr, "%s: could not resume from %s\n",
+                    argv[0], resume_file);
+            exit(EXIT_FAILURE);
+        }
+        width = resume.image->width;
+        height = resume.image->height;
+        depth = resume.colorset->depth;
+        gamma = resume.gamma;
+    }
+    /* Delta records hold 8-bit samples, but deeper frames are 16-bit. */
+    if (deltas && depth > 8) {
+        fprintf(stderr, "%s: -D needs a depth of 8 or less\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (deltas && (uint64_t)width * height > UINT32_MAX) {
+        fprintf(stderr, "%s: -D needs at most 2^32 - 1 pixels\n", argv[0]);
+        exit(EXIT_FAILURE);
     }
-    image *image = image_create(width, height);
-    colorset *colorset = colorset_create(depth, gamma);
-    colorset_shuffle(colorset, &seed);
 
-    if (nstarts == 0) {
+    if (method == METHOD_KDFLAT &&
+        (width > KDFLAT_MAX_SIZE || height > KDFLAT_MAX_SIZE)) {
+        fprintf(stderr, "%s: -F needs a size of %d or less\n",
+                argv[0], KDFLAT_MAX_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (method == METHOD_LATTICE &&
+        (width > LATTICE_MAX_SIZE || height > LATTICE_MAX_SIZE ||
+         depth > LATTICE_MAX_DEPTH)) {
+        fprintf(stderr, "%s: -L needs a size of %d or less and a depth "
+                "of %d or less\n", argv[0], LATTICE_MAX_SIZE,
+                LATTICE_MAX_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+
+    struct finder_options options = {method, depth, gamma, epsilon};
+    finder *finder = create_finder(&options, width, height);
+    image *image;
+    colorset *colorset;
+    rng shuffle = rng_stream(seed, RNG_SHUFFLE);
+    rng place = rng_stream(seed, RNG_PLACE);
+    if (resume_file) {
+        image = resume.image;
+        colorset = resume.colorset;
+        place = resume.rng;
+    } else if (lazy) {
+        image = image_create(width, height, depth, gamma);
+        colorset = colorset_create_lazy(depth, gamma, &shuffle);
+    } else {
+        image = image_create(width, height, depth, gamma);
+        colorset = colorset_create(depth, gamma);
+        colorset_order(colorset, order, &shuffle);
+    }
+
+    bool tiled = cols > 0 && rows > 0 && !resume_file;
+    if (nstarts == 0 && !tiled) {
         starts[0].x = image->width / 2;
         starts[0].y = image->height / 2;
         nstarts++;
     }
 
-    for (int i = 0; i < nstarts; i++) {
-        edge start = {
-            .x = starts[i].x,
-            .y = starts[i].y,
-            .color = colorset_pop(colorset)
+    grow grow;
+    grow_init(&grow, image, colorset, finder, &place);
+    if (threads > 0)
+        grow.spec = spec_create(threads);
+    if (deltas)
+        grow.delta = delta_create(output, width, height);
+    if (resume_file)
+        grow.pixels_left = resume.pixels_left;
+    if (tiled) {
+        tiling tiling = {
+            .cols = cols,
+            .rows = rows,
+            .threads = threads > 0 ? threads : 1,
+            .gamma = gamma,
+            .prune = prune,
+            .verbose = verbose > 0,
+            .create = create_finder,
+            .ctx = &options,
+            .nstarts = nstarts,
         };
-        image_set(image, start.x, start.y, start.color);
-        finder_add(finder, start);
+        for (int i = 0; i < nstarts; i++) {
+            tiling.starts[i].x = starts[i].x;
+            tiling.starts[i].y = starts[i].y;
+        }
+        tile_grow(&grow, &tiling);
     }
-    size_t pixels_left = image->width * image->height - nstarts;
-    while (colorset->count > 0 && pixels_left > 0) {
+    if (prune)
+        grow_prune(&grow);
+    if (resume_file) {
+        for (size_t i = 0; i < resume.count; i++)
+            finder_add(finder, resume.frontier[i]);
+        free(resume.frontier);
+    }
+    if (resume_file || tiled) {
+        /* Open a delta stream with everything placed so far. */
+        for (uint32_t y = 0; grow.delta && y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                if (image_occupied(image, x, y)) {
+                    uint8_t rgb[3];
+                    image_rgb(image, x, y, rgb);
+                    delta_pixel(grow.delta, x, y, rgb);
+                }
+            }
+        }
+    } else {
+        for (int i = 0; i < nstarts; i++)
+            grow_start(&grow, starts[i].x, starts[i].y);
+    }
+    while (!grow_done(&grow)) {
         if (verbose && colorset->count % 4096 == 0)
             fprintf(stderr, "%zu colors remaining\n", colorset->count);
         if (steps > 0 && colorset->count % steps == 0)
-            image_save(image, gamma, output);
-        color next_color = colorset_pop(colorset);
-        int count = 0;
-        do {
-            edge target;
-            finder_nearest(finder, next_color, &target);
-            edge border[8];
-            for (int y = -1; y <= 1; y++) {
-                for (int x = -1; x <= 1; x++) {
-                    uint32_t tx = target.x + x;
-                    uint32_t ty = target.y + y;
-                    if (image_get(image, tx, ty).p.a == 0)
-                        border[count++] = (edge){tx, ty, next_color};
-                }
-            }
-            if (count > 0) {
-                edge result = border[xorshift(&seed) % count];
-                image_set(image, result.x, result.y, result.color);
-                pixels_left--;
-                finder_add(finder, result);
-            } else {
-                finder_remove(finder, target);
+            write_frame(&grow, output);
+        if (stats && colorset->count % STATS_PERIOD == 0)
+            stats_write(stats, stats_seconds(), colorset->count,
+                        grow.placed, grow.retries);
+        grow_step(&grow);
+        if (checkpoint_file && colorset->count % every == 0) {
+            if (!checkpoint_save(checkpoint_file, &grow, gamma)) {
+                perror(checkpoint_file);
+                exit(EXIT_FAILURE);
             }
-        } while (count == 0);
+        }
     }
 
-    image_save(image, gamma, output);
+    write_frame(&grow, output);
+    if (grow.delta)
+        delta_free(grow.delta);
+    if (stats) {
+        stats_write(stats, stats_seconds(), colorset->count,
+                    grow.placed, grow.retries);
+        fclose(stats);
+    }
+    if (verbose > 1)
+        stats_write(stderr, stats_seconds(), colorset->count,
+                    grow.placed, grow.retries);
+    if (verbose)
+        fprintf(stderr, "%zu retries in %zu placements (%.3f each)\n",
+                grow.retries, grow.placed,
+                grow.placed ? (double)grow.retries / grow.placed : 0.0);
+    if (grow.spec)
+        spec_free(grow.spec);
+    free(grow.free);
     colorset_free(colorset);
     image_free(image);
     finder_free(finder);
@@ -1,57 +1,212 @@
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include "colorset.h"
-#include "rand.h"
 
-colorset *
-colorset_create(int depth, float gamma)
+/* Every module that maps levels to values goes through here, so that a
+ * color popped from a set always finds its level in an image or a
+ * lattice by exact comparison.
+ */
+float
+colorset_level(int depth, float gamma, uint32_t i)
+{
+    float den = (UINT32_C(1) << depth) - 1;
+    return powf(i / den, gamma);
+}
+
+static colorset *
+colorset_alloc(int depth, float gamma, size_t stored)
 {
-    size_t count = 1 << (3 * depth);
+    assert(depth > 0 && depth <= COLORSET_MAX_DEPTH);
     colorset *set;
-    size_t size = sizeof(*set) + count * sizeof(set->colors[0]);
-    set = malloc(size);
+    set = malloc(sizeof(*set) + stored * sizeof(set->indices[0]));
     set->depth = depth;
-    set->count = 0;
-    int bits = 1 << depth;
-    float den = bits - 1;
-    for (int r = 0; r < bits; r++)
-        for (int g = 0; g < bits; g++)
-            for (int b = 0; b < bits; b++)
-                set->colors[set->count++] =
-                    COLOR(r / den, g / den, b / den, gamma);
+    set->count = (size_t)1 << (3 * depth);
+    set->lazy = false;
+    set->offset = 0;
+    uint32_t levels = UINT32_C(1) << depth;
+    set->values = malloc(levels * sizeof(set->values[0]));
+    for (uint32_t i = 0; i < levels; i++)
+        set->values[i] = colorset_level(depth, gamma, i);
     return set;
 }
 
-void
-colorset_shuffle(colorset *set, uint64_t *state)
+colorset *
+colorset_create(int depth, float gamma)
+{
+    colorset *set = colorset_alloc(depth, gamma, (size_t)1 << (3 * depth));
+    for (size_t i = 0; i < set->count; i++)
+        set->indices[i] = i;
+    return set;
+}
+
+/* Already in a random order, so there is nothing to shuffle. */
+colorset *
+colorset_create_lazy(int depth, float gamma, rng *r)
+{
+    colorset *set = colorset_alloc(depth, gamma, 0);
+    set->lazy = true;
+    for (int k = 0; k < COLORSET_ROUNDS; k++)
+        set->keys[k] = rng_next(r);
+    return set;
+}
+
+/* A new set holding positions start .. start + count - 1 of set, which
+ * pop in the same order as they would have from set.
+ */
+colorset *
+colorset_slice(const colorset *set, size_t start, size_t count)
+{
+    assert(start + count <= set->count);
+    size_t stored = set->lazy ? 0 : count;
+    colorset *slice;
+    slice = malloc(sizeof(*slice) + stored * sizeof(slice->indices[0]));
+    *slice = *set;
+    slice->count = count;
+    slice->offset = set->offset + start;
+    size_t levels = (size_t)1 << set->depth;
+    slice->values = malloc(levels * sizeof(slice->values[0]));
+    memcpy(slice->values, set->values, levels * sizeof(slice->values[0]));
+    if (!set->lazy)
+        memcpy(slice->indices, set->indices + start,
+               count * sizeof(slice->indices[0]));
+    return slice;
+}
+
+/* Fisher-Yates from the end, drawing the indices a block at a time. */
+static void
+colorset_shuffle_range(uint32_t *v, size_t n, rng *r)
 {
-    for (size_t i = set->count - 1; i > 0; i--) {
-        int j = xorshift(state) % (i + 1);
-        color tmp = set->colors[i];
-        set->colors[i] = set->colors[j];
-        set->colors[j] = tmp;
+    uint32_t j[COLORSET_SHUFFLE_BLOCK];
+    for (size_t i = n; i > 1;) {
+        size_t m = i - 1 < COLORSET_SHUFFLE_BLOCK ?
+            i - 1 : COLORSET_SHUFFLE_BLOCK;
+        rng_fill(r, j, m, i);
+        for (size_t k = 0; k < m; k++, i--) {
+            uint32_t tmp = v[i - 1];
+            v[i - 1] = v[j[k]];
+            v[j[k]] = tmp;
+        }
     }
 }
 
+void
+colorset_shuffle(colorset *set, rng *r)
+{
+    assert(!set->lazy);
+    colorset_shuffle_range(set->indices, set->count, r);
+}
+
 static int
 cmp(const void *a, const void *b)
 {
-    return color_cmp(*(color *)a, *(color *)b);
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    return (ia > ib) - (ia < ib);
 }
 
+/* Levels are increasing, so index order is color_cmp() order. */
 void
 colorset_sort(colorset *set)
 {
-    qsort(set->colors, set->count, sizeof(set->colors[0]), cmp);
+    assert(!set->lazy);
+    qsort(set->indices, set->count, sizeof(set->indices[0]), cmp);
+}
+
+/* Interleaved bits of a Morton code back into a packed index. */
+static uint32_t
+colorset_unmorton(uint32_t m, int depth)
+{
+    uint32_t c[3] = {0, 0, 0};
+    for (int j = 0; j < depth; j++)
+        for (int i = 0; i < 3; i++)
+            c[i] |= (m >> (3 * j + 2 - i) & 1) << j;
+    return c[0] << (2 * depth) | c[1] << depth | c[2];
+}
+
+/* Hilbert index back into a packed index, using Skilling's transpose
+ * form ("Programming the Hilbert curve", 2004).
+ */
+static uint32_t
+colorset_unhilbert(uint32_t h, int depth)
+{
+    uint32_t x[3] = {0, 0, 0};
+    for (int j = 0; j < depth; j++)
+        for (int i = 0; i < 3; i++)
+            x[i] |= (h >> (3 * j + 2 - i) & 1) << j;
+
+    /* Gray decode, then undo the excess rotations. */
+    uint32_t t = x[2] >> 1;
+    for (int i = 2; i > 0; i--)
+        x[i] ^= x[i - 1];
+    x[0] ^= t;
+    for (uint32_t q = 2; q != UINT32_C(1) << depth; q <<= 1) {
+        uint32_t p = q - 1;
+        for (int i = 2; i >= 0; i--) {
+            if (x[i] & q) {
+                x[0] ^= p;
+            } else {
+                t = (x[0] ^ x[i]) & p;
+                x[0] ^= t;
+                x[i] ^= t;
+            }
+        }
+    }
+    return x[0] << (2 * depth) | x[1] << depth | x[2];
+}
+
+/* Arrange a full, stored set so that pops follow the given order. */
+void
+colorset_order(colorset *set, enum colorset_order order, rng *r)
+{
+    assert(!set->lazy);
+    size_t n = set->count;
+    int depth = set->depth;
+    switch (order) {
+        case COLORSET_RANDOM:
+            colorset_shuffle(set, r);
+            break;
+        case COLORSET_SORTED:
+            colorset_sort(set);
+            break;
+        case COLORSET_MORTON:
+            for (size_t i = 0; i < n; i++)
+                set->indices[n - 1 - i] = colorset_unmorton(i, depth);
+            break;
+        case COLORSET_HILBERT:
+            for (size_t i = 0; i < n; i++)
+                set->indices[n - 1 - i] = colorset_unhilbert(i, depth);
+            break;
+        case COLORSET_BLOCKED: {
+            /* Buckets are aligned Morton ranges, so each is a cube. */
+            int shift = depth < COLORSET_BLOCK ? depth : COLORSET_BLOCK;
+            size_t size = (size_t)1 << (3 * shift);
+            size_t nblocks = n / size;
+            uint32_t *blocks = malloc(nblocks * sizeof(blocks[0]));
+            for (size_t b = 0; b < nblocks; b++)
+                blocks[b] = b;
+            colorset_shuffle_range(blocks, nblocks, r);
+            for (size_t b = 0; b < nblocks; b++) {
+                uint32_t *v = set->indices + b * size;
+                for (size_t i = 0; i < size; i++)
+                    v[i] = colorset_unmorton(blocks[b] * size + i, depth);
+                colorset_shuffle_range(v, size, r);
+            }
+            free(blocks);
+        } break;
+    }
 }
 
 color
 colorset_pop(colorset *set)
 {
-    return set->colors[--set->count];
+    set->count--;
+    return colorset_color(set, colorset_at(set, set->count));
 }
 
 void
 colorset_free(const colorset *set)
 {
+    free(set->values);
     free((void *)set);
 }
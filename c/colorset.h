@@ -1,16 +1,112 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "color.h"
+#include "rand.h"
 
+#define COLORSET_MAX_DEPTH 10
+#define COLORSET_ROUNDS    4
+#define COLORSET_BLOCK     4   /* blocked shuffle buckets are 16^3 */
+#define COLORSET_SHUFFLE_BLOCK 256  /* random indices drawn at a time */
+
+/* Pop order of a stored colorset. All but random keep consecutive
+ * colors close together, walking the RGB cube along a curve.
+ */
+enum colorset_order {
+    COLORSET_RANDOM,   /* Fisher-Yates shuffle */
+    COLORSET_SORTED,   /* by red, then green, then blue */
+    COLORSET_MORTON,   /* Z-order curve */
+    COLORSET_HILBERT,  /* Hilbert curve */
+    COLORSET_BLOCKED   /* shuffled buckets, each shuffled within */
+};
+
+/* Colors are kept as packed lattice indices, r << 2d | g << d | b for
+ * depth d, and only turned into gamma-space colors as they are used. A
+ * color takes 4 bytes instead of 16, so all 2^30 colors of depth 10
+ * fit in 4 GiB.
+ *
+ * A lazy colorset stores no indices at all. Position i holds the image
+ * of i under a keyed Feistel permutation of the lattice indices, so it
+ * starts instantly and takes constant memory.
+ */
 typedef struct colorset {
     int depth;
     size_t count;
-    color colors[];
+    float *values;       /* gamma-space value per level */
+    bool lazy;
+    uint64_t keys[COLORSET_ROUNDS];  /* round keys, when lazy */
+    size_t offset;       /* first permutation position, when lazy */
+    uint32_t indices[];  /* popped from the end, unless lazy */
 } colorset;
 
+float     colorset_level(int depth, float gamma, uint32_t level);
 colorset *colorset_create(int depth, float gamma);
+colorset *colorset_create_lazy(int depth, float gamma, rng *);
+colorset *colorset_slice(const colorset *, size_t start, size_t count);
 void      colorset_free(const colorset *);
 color     colorset_pop(colorset *);
-void      colorset_shuffle(colorset *, uint64_t *);
+void      colorset_shuffle(colorset *, rng *);
 void      colorset_sort(colorset *);
+void      colorset_order(colorset *, enum colorset_order, rng *);
+
+static inline color
+colorset_color(const colorset *set, uint32_t index)
+{
+    int d = set->depth;
+    uint32_t mask = (UINT32_C(1) << d) - 1;
+    return (color){{
+        set->values[index >> (2 * d)],
+        set->values[index >> d & mask],
+        set->values[index & mask],
+        1.0f
+    }};
+}
+
+static inline uint32_t
+colorset_round(uint32_t half, uint64_t key)
+{
+    uint64_t h = (half + key) * UINT64_C(0x9e3779b97f4a7c15);
+    h ^= h >> 29;
+    h *= UINT64_C(0xbf58476d1ce4e5b9);
+    return h >> 32;
+}
+
+/* A balanced Feistel network over the smallest even bit width that
+ * covers the 3 * depth index bits. Outputs past the end are fed back
+ * in (cycle walking) until one lands inside, which keeps the mapping a
+ * bijection. Odd widths walk at most a couple of times on average.
+ */
+static inline uint32_t
+colorset_permute(const colorset *set, uint32_t i)
+{
+    int half = (3 * set->depth + 1) / 2;
+    uint32_t mask = (UINT32_C(1) << half) - 1;
+    uint32_t limit = UINT32_C(1) << (3 * set->depth);
+    do {
+        uint32_t l = i >> half;
+        uint32_t r = i & mask;
+        for (int k = 0; k < COLORSET_ROUNDS; k++) {
+            uint32_t t = l ^ (colorset_round(r, set->keys[k]) & mask);
+            l = r;
+            r = t;
+        }
+        i = l << half | r;
+    } while (i >= limit);
+    return i;
+}
+
+/* The packed index at position i, counting from the bottom. */
+static inline uint32_t
+colorset_at(const colorset *set, size_t i)
+{
+    return set->lazy ?
+        colorset_permute(set, set->offset + i) : set->indices[i];
+}
+
+/* The color that the i-th next pop will return. */
+static inline color
+colorset_peek(const colorset *set, size_t i)
+{
+    return colorset_color(set, colorset_at(set, set->count - 1 - i));
+}
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+delta *
+delta_create(FILE *out, uint32_t width, uint32_t height)
+{
+    delta *d = malloc(sizeof(*d));
+    d->out = out;
+    d->width = width;
+    d->count = 0;
+    d->max = 4096;
+    d->records = malloc(d->max * DELTA_RECORD);
+    uint8_t header[12];
+    memcpy(header, DELTA_MAGIC, 4);
+    delta_put32(header + 4, width);
+    delta_put32(header + 8, height);
+    fwrite(header, sizeof(header), 1, out);
+    return d;
+}
+
+void
+delta_free(delta *d)
+{
+    free(d->records);
+    free(d);
+}
+
+void
+delta_pixel(delta *d, uint32_t x, uint32_t y, const uint8_t rgb[3])
+{
+    if (d->count == d->max) {
+        d->max *= 2;
+        d->records = realloc(d->records, d->max * DELTA_RECORD);
+    }
+    uint8_t *p = d->records + d->count++ * DELTA_RECORD;
+    delta_put32(p, y * d->width + x);
+    memcpy(p + 4, rgb, 3);
+}
+
+void
+delta_frame(delta *d)
+{
+    uint8_t count[4];
+    delta_put32(count, d->count);
+    fwrite(count, sizeof(count), 1, d->out);
+    fwrite(d->records, DELTA_RECORD, d->count, d->out);
+    fflush(d->out);
+    d->count = 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A video stream that records only the pixels placed between frames.
+ *
+ * The stream opens with the magic "RGBD" and then the width and height.
+ * Each frame is a count followed by that many records. A record is a
+ * pixel index (y * width + x) and three 8-bit channels. All integers
+ * are 32-bit little endian. The undelta tool turns a stream back into
+ * the full P6 frames that image_save() would have written. Samples are
+ * 8-bit, so streams are only written up to depth 8, and indices are
+ * 32-bit, so only for images of fewer than 2^32 pixels.
+ */
+typedef struct delta {
+    FILE *out;
+    uint32_t width;
+    size_t count, max;
+    uint8_t *records;
+} delta;
+
+#define DELTA_MAGIC  "RGBD"
+#define DELTA_RECORD 7
+
+delta *delta_create(FILE *out, uint32_t width, uint32_t height);
+void   delta_free(delta *);
+void   delta_pixel(delta *, uint32_t x, uint32_t y, const uint8_t rgb[3]);
+void   delta_frame(delta *);
+
+static inline void
+delta_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >>  0;
+    p[1] = v >>  8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t
+delta_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] <<  0 | (uint32_t)p[1] <<  8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
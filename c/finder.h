@@ -3,39 +3,212 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "color.h"
+#include "stats.h"
 
 typedef struct edge {
     uint32_t x, y;
     color color;
 } edge;
 
+/* An edge that is never in a finder, for an empty hint. */
+#define EDGE_NONE ((edge){UINT32_MAX, UINT32_MAX, {{0, 0, 0, 0}}})
+
+/* True if a candidate at dist2 beats the best so far. Ties go to the
+ * lower position so that every backend agrees on exactly one answer.
+ */
+static inline bool
+edge_closer(float dist2, edge e, float best2, edge best)
+{
+    if (dist2 != best2)
+        return dist2 < best2;
+    return e.y != best.y ? e.y < best.y : e.x < best.x;
+}
+
+/* The k best edges seen so far, ordered by edge_closer(). */
+typedef struct nearest_set {
+    size_t k, count;
+    float *dist2;
+    edge *edges;
+} nearest_set;
+
+/* Anything farther than this cannot enter the set. */
+static inline float
+nearest_bound(const nearest_set *s)
+{
+    return s->count < s->k ? INFINITY : s->dist2[s->k - 1];
+}
+
+static inline void
+nearest_insert(nearest_set *s, float dist2, edge e)
+{
+    size_t i = s->count;
+    if (i == s->k) {
+        if (!edge_closer(dist2, e, s->dist2[i - 1], s->edges[i - 1]))
+            return;
+        i--;
+    } else {
+        s->count++;
+    }
+    for (; i > 0 && edge_closer(dist2, e, s->dist2[i - 1], s->edges[i - 1]);
+         i--) {
+        s->dist2[i] = s->dist2[i - 1];
+        s->edges[i] = s->edges[i - 1];
+    }
+    s->dist2[i] = dist2;
+    s->edges[i] = e;
+}
+
 typedef struct finder {
-    bool  (*add)(struct finder *, edge);
-    bool  (*remove)(struct finder *, edge);
-    float (*nearest)(const struct finder *, color, edge *);
-    void  (*free)(const struct finder *);
+    bool   (*add)(struct finder *, edge);
+    bool   (*remove)(struct finder *, edge);
+    float  (*nearest)(const struct finder *, color, edge *);
+    /* Like nearest, but *e holds a hint, usually the previous result.
+     * If it is still in the finder, it bounds the search from the
+     * start. The answer is the same either way. May be NULL.
+     */
+    float  (*nearest_from)(const struct finder *, color, edge *);
+    void   (*nearest_k)(const struct finder *, color, nearest_set *);
+    void   (*free)(const struct finder *);
+    float  slack;  /* (1 + epsilon)^2 for approximate lookups, else 1 */
 } finder;
 
+/* Backends that can be bound at compile time, as in
+ * -DFINDER_STATIC=FINDER_KDTREE. Every finder in such a build must come
+ * from that backend, whose methods are then called directly instead of
+ * through the table, so that they can be inlined with -flto.
+ */
+#define FINDER_NAIVE   1
+#define FINDER_OCTREE  2
+#define FINDER_KDTREE  3
+#define FINDER_KDFLAT  4
+#define FINDER_LATTICE 5
+
+#ifdef FINDER_STATIC
+bool   finder_static_add(finder *, edge);
+bool   finder_static_remove(finder *, edge);
+float  finder_static_nearest(const finder *, color, edge *);
+float  finder_static_nearest_from(const finder *, color, edge *);
+void   finder_static_nearest_k(const finder *, color, nearest_set *);
+void   finder_static_free(const finder *);
+#  define FINDER_CALL(f, method) finder_static_##method
+#else
+#  define FINDER_CALL(f, method) (f)->method
+#endif
+
 static inline bool
 finder_add(finder *f, edge e)
 {
-    return f->add(f, e);
+    STATS_START();
+    bool added = FINDER_CALL(f, add)(f, e);
+    STATS_STOP(STAT_ADD, 1);
+    return added;
 }
 
 static inline bool
 finder_remove(finder *f, edge e)
 {
-    return f->remove(f, e);
+    STATS_START();
+    bool removed = FINDER_CALL(f, remove)(f, e);
+    STATS_STOP(STAT_REMOVE, 1);
+    return removed;
 }
 
 static inline float
 finder_nearest(finder *f, color c, edge *e)
 {
-    return f->nearest(f, c, e);
+    STATS_START();
+    float dist = FINDER_CALL(f, nearest)(f, c, e);
+    STATS_STOP(STAT_NEAREST, 1);
+    return dist;
+}
+
+/* Look up the nearest edge starting from the hint in *e. */
+static inline float
+finder_nearest_from(finder *f, color c, edge *e)
+{
+#ifndef FINDER_STATIC
+    if (!f->nearest_from)
+        return finder_nearest(f, c, e);
+#endif
+    STATS_START();
+    float dist = FINDER_CALL(f, nearest_from)(f, c, e);
+    STATS_STOP(STAT_NEAREST, 1);
+    return dist;
+}
+
+/* Fill out with up to k nearest edges, closest first, returning how
+ * many were found. Intended for small k.
+ */
+static inline size_t
+finder_nearest_k(const finder *f, color c, size_t k, edge *out)
+{
+    if (k == 0)
+        return 0;
+    float dist2[k];
+    nearest_set set = {k, 0, dist2, out};
+    STATS_START();
+    FINDER_CALL(f, nearest_k)(f, c, &set);
+    STATS_STOP(STAT_NEAREST, 1);
+    return set.count;
+}
+
+/* Look up the nearest edge for each of n colors, returning n, or 0 if
+ * the finder is empty. Each lookup is hinted with the previous answer.
+ */
+static inline size_t
+finder_nearest_many(const finder *f, const color *c, size_t n, edge *out)
+{
+    STATS_START();
+#ifdef FINDER_STATIC
+    bool hinted = true;
+#else
+    bool hinted = f->nearest_from != NULL;
+#endif
+    for (size_t i = 0; i < n; i++) {
+        float dist;
+        if (hinted) {
+            out[i] = i ? out[i - 1] : EDGE_NONE;
+            dist = FINDER_CALL(f, nearest_from)(f, c[i], out + i);
+        } else {
+            dist = FINDER_CALL(f, nearest)(f, c[i], out + i);
+        }
+        if (!isfinite(dist)) {
+            n = 0;
+            break;
+        }
+    }
+    STATS_STOP(STAT_NEAREST, n);
+    return n;
+}
+
+/* Allow nearest() to return an edge up to 1 + epsilon times farther
+ * than the true nearest. Backends without pruning stay exact.
+ */
+static inline void
+finder_approximate(finder *f, float epsilon)
+{
+    f->slack = (1.0f + epsilon) * (1.0f + epsilon);
 }
 
 static inline void
 finder_free(const finder *f)
 {
-    f->free(f);
+    FINDER_CALL(f, free)(f);
 }
+
+/* Define the finder_static_* entry points in the chosen backend, after
+ * its method_* functions.
+ */
+#define FINDER_STATIC_DEFINE() \
+    bool finder_static_add(finder *f, edge e) \
+    { return method_add(f, e); } \
+    bool finder_static_remove(finder *f, edge e) \
+    { return method_remove(f, e); } \
+    float finder_static_nearest(const finder *f, color c, edge *e) \
+    { return method_nearest(f, c, e); } \
+    float finder_static_nearest_from(const finder *f, color c, edge *e) \
+    { return method_nearest_from(f, c, e); } \
+    void finder_static_nearest_k(const finder *f, color c, nearest_set *s) \
+    { method_nearest_k(f, c, s); } \
+    void finder_static_free(const finder *f) \
+    { method_free(f); }
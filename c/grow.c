@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "grow.h"
+
+/* Candidates fetched at a time once the nearest edge turns out dead. */
+#define GROW_CANDIDATES 8
+
+void
+grow_init(grow *g, image *image, colorset *colorset, finder *finder,
+          const rng *rng)
+{
+    g->image = image;
+    g->colorset = colorset;
+    g->finder = finder;
+    g->rng = *rng;
+    g->pixels_left = (size_t)image->width * image->height;
+    g->spec = NULL;
+    g->delta = NULL;
+    g->free = NULL;
+    g->placed = 0;
+    g->retries = 0;
+    g->hint = EDGE_NONE;
+}
+
+static int
+grow_count_free(const image *im, uint32_t x, uint32_t y)
+{
+    return __builtin_popcount(image_neighbors(im, x, y));
+}
+
+/* Start tracking free neighbors so that edges leave the finder as soon
+ * as they are surrounded, rather than when a lookup stumbles on them.
+ * Dead edges can never be chosen, so the image comes out the same.
+ */
+void
+grow_prune(grow *g)
+{
+    const image *im = g->image;
+    g->free = malloc((size_t)im->width * im->height);
+    for (uint32_t y = 0; y < im->height; y++) {
+        for (uint32_t x = 0; x < im->width; x++) {
+            size_t i = (size_t)y * im->width + x;
+            g->free[i] = image_occupied(im, x, y) ?
+                grow_count_free(im, x, y) : 0;
+        }
+    }
+}
+
+/* Account for a newly filled pixel and evict any neighbor it leaves
+ * with no free neighbors. Returns false if the pixel is dead already.
+ */
+static bool
+grow_settle(grow *g, uint32_t x, uint32_t y)
+{
+    image *im = g->image;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            uint32_t nx = x + dx;
+            uint32_t ny = y + dy;
+            if ((!dx && !dy) || nx >= im->width || ny >= im->height)
+                continue;
+            uint8_t *free = g->free + (size_t)ny * im->width + nx;
+            if (*free > 0 && --*free == 0) {
+                edge dead = {nx, ny, image_get(im, nx, ny)};
+                finder_remove(g->finder, dead);
+                if (g->spec)
+                    spec_removed(g->spec, dead);
+            }
+        }
+    }
+    size_t i = (size_t)y * im->width + x;
+    g->free[i] = grow_count_free(im, x, y);
+    return g->free[i] > 0;
+}
+
+/* Fill a pixel, returning true if it joined the frontier. */
+static bool
+grow_place(grow *g, edge e)
+{
+    image_set(g->image, e.x, e.y, e.color);
+    g->pixels_left--;
+    g->placed++;
+    bool live = !g->free || grow_settle(g, e.x, e.y);
+    if (live)
+        finder_add(g->finder, e);
+    if (g->delta) {
+        uint8_t rgb[3];
+        image_rgb(g->image, e.x, e.y, rgb);
+        delta_pixel(g->delta, e.x, e.y, rgb);
+    }
+    return live;
+}
+
+void
+grow_start(grow *g, uint32_t x, uint32_t y)
+{
+    edge start = {
+        .x = x,
+        .y = y,
+        .color = colorset_pop(g->colorset)
+    };
+    grow_place(g, start);
+}
+
+void
+grow_step(grow *g)
+{
+    color next_color = colorset_pop(g->colorset);
+    edge target = g->hint;
+    bool known = g->spec &&
+        spec_nearest(g->spec, g->finder, g->colorset, next_color, &target);
+    if (!known) {
+        target = g->hint;
+        finder_nearest_from(g->finder, next_color, &target);
+    }
+
+    /* Once one dead edge turns up, more are likely to follow, so fetch
+     * several candidates at once. After removing a dead candidate, the
+     * next one in the list is the nearest remaining edge.
+     */
+    edge candidates[GROW_CANDIDATES];
+    size_t ncandidates = 0;
+    size_t next = 0;
+    for (;;) {
+        uint32_t mask = image_neighbors(g->image, target.x, target.y);
+        uint32_t count = __builtin_popcount(mask);
+        if (count > 0) {
+            g->hint = target;
+            int dx, dy;
+            image_neighbor(mask, rng_below(&g->rng, count), &dx, &dy);
+            edge result = {target.x + dx, target.y + dy, next_color};
+            if (grow_place(g, result) && g->spec)
+                spec_added(g->spec, result);
+            return;
+        }
+        g->retries++;
+        STATS_ADD(STAT_RETRY, 1);
+        finder_remove(g->finder, target);
+        if (g->spec)
+            spec_removed(g->spec, target);
+        if (next == ncandidates) {
+            ncandidates = finder_nearest_k(g->finder, next_color,
+                                           GROW_CANDIDATES, candidates);
+            next = 0;
+            assert(ncandidates > 0);
+        }
+        target = candidates[next++];
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "finder.h"
+#include "image.h"
+#include "colorset.h"
+#include "spec.h"
+#include "delta.h"
+#include "rand.h"
+
+/* State of a single image being grown from its start points. */
+typedef struct grow {
+    image *image;
+    colorset *colorset;
+    finder *finder;
+    rng rng;       /* neighbor choice */
+    size_t pixels_left;
+    spec *spec;    /* optional speculative lookups */
+    delta *delta;  /* optional record of placed pixels */
+    uint8_t *free; /* free neighbors per pixel, when pruning eagerly */
+    size_t placed;
+    size_t retries;  /* dead edges found by a nearest lookup */
+    edge hint;       /* previous match, where the next lookup starts */
+} grow;
+
+void grow_init(grow *, image *, colorset *, finder *, const rng *);
+void grow_prune(grow *);
+void grow_start(grow *, uint32_t x, uint32_t y);
+void grow_step(grow *);
+
+static inline bool
+grow_done(const grow *g)
+{
+    return g->colorset->count == 0 || g->pixels_left == 0;
+}
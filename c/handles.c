@@ -0,0 +1,20 @@
+#include <stdlib.h>
+#include <string.h>
+#include "handles.h"
+
+handles *
+handles_create(uint32_t width, uint32_t height)
+{
+    size_t count = (size_t)width * height;
+    handles *h = malloc(sizeof(*h) + count * sizeof(h->slots[0]));
+    h->width = width;
+    h->height = height;
+    memset(h->slots, 0xff, count * sizeof(h->slots[0]));
+    return h;
+}
+
+void
+handles_free(const handles *h)
+{
+    free((void *)h);
+}
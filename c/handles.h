@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#define HANDLE_NONE UINT32_MAX
+
+/* Where each frontier pixel currently sits inside a finder, indexed by
+ * y * width + x, so that removal never has to search for it. What a
+ * slot means is up to the finder. Pixels it doesn't hold are
+ * HANDLE_NONE.
+ */
+typedef struct handles {
+    uint32_t width, height;
+    uint32_t slots[];
+} handles;
+
+handles *handles_create(uint32_t width, uint32_t height);
+void     handles_free(const handles *);
+
+static inline uint32_t
+handles_get(const handles *h, uint32_t x, uint32_t y)
+{
+    if (x >= h->width || y >= h->height)
+        return HANDLE_NONE;
+    return h->slots[(size_t)y * h->width + x];
+}
+
+static inline void
+handles_set(handles *h, uint32_t x, uint32_t y, uint32_t slot)
+{
+    h->slots[(size_t)y * h->width + x] = slot;
+}
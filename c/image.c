@@ -1,39 +1,104 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "image.h"
+#include "colorset.h"
 
 image *
-image_create(uint32_t width, uint32_t height)
+image_create(uint32_t width, uint32_t height, int depth, float gamma)
 {
-    image *image;
-    size_t size = sizeof(*image) + width * height * sizeof(image->pixels[0]);
-    image = calloc(size, 1);
+    assert(depth > 0 && depth <= IMAGE_MAX_DEPTH);
+    image *image = malloc(sizeof(*image));
     image->width = width;
     image->height = height;
+    image->depth = depth;
+    size_t pixels = (size_t)width * height;
+    image->levels = malloc(pixels * sizeof(image->levels[0]));
+    image->stride = ((size_t)width + 2 + 63) / 64;
+    image->occupied = calloc(image_occupied_size(image), 1);
+    /* Fill in the border. */
+    size_t last = ((size_t)height + 1) * image->stride;
+    memset(image->occupied, 0xff, image->stride * 8);
+    memset(image->occupied + last, 0xff, image->stride * 8);
+    for (size_t y = 1; y <= height; y++) {
+        uint64_t *row = image->occupied + y * image->stride;
+        size_t x = (size_t)width + 1;
+        row[0] |= 1;
+        row[x / 64] |= UINT64_C(1) << (x % 64);
+    }
+
+    /* Keep the table at most a quarter full. */
+    int levels = 1 << depth;
+    int bits = depth + 2;
+    image->shift = 32 - bits;
+    image->values = malloc(levels * sizeof(image->values[0]));
+    image->bytes = malloc(levels * sizeof(image->bytes[0]));
+    image->words = malloc(levels * sizeof(image->words[0]));
+    image->keys = malloc(sizeof(image->keys[0]) << bits);
+    image->slots = malloc(sizeof(image->slots[0]) << bits);
+    for (size_t i = 0; i < (size_t)1 << bits; i++)
+        image->keys[i] = IMAGE_EMPTY;
+
+    float inv = 1.0f / gamma;
+    uint32_t mask = (UINT32_C(1) << bits) - 1;
+    for (int i = 0; i < levels; i++) {
+        float v = colorset_level(depth, gamma, i);
+        image->values[i] = v;
+        image->bytes[i] = powf(v, inv) * 255;
+        image->words[i] = powf(v, inv) * 65535 + 0.5f;
+        uint32_t key;
+        memcpy(&key, &v, sizeof(key));
+        uint32_t j = image_slot(image, key);
+        while (image->keys[j] != IMAGE_EMPTY && image->keys[j] != key)
+            j = (j + 1) & mask;
+        image->keys[j] = key;
+        image->slots[j] = i;
+    }
     return image;
 }
+
+/* Write a row at a time, as 8-bit samples up to depth 8 and as
+ * big-endian 16-bit samples deeper than that. Free pixels are black.
+ */
 void
-image_save(image *im, float gamma, FILE *out)
+image_save(const image *im, FILE *out)
 {
-    uint8_t *buffer = malloc(im->width * im->height * 3);
-    fprintf(out, "P6\n%d %d\n255\n", im->width, im->height);
-    float inv = 1.0f / gamma;
+    bool wide = im->depth > 8;
+    fprintf(out, "P6\n%lu %lu\n%d\n",
+            (unsigned long)im->width, (unsigned long)im->height,
+            wide ? 65535 : 255);
+    uint8_t *row = malloc((size_t)im->width * (wide ? 6 : 3));
+    uint32_t mask = (UINT32_C(1) << im->depth) - 1;
     for (uint32_t y = 0; y < im->height; y++) {
+        uint8_t *p = row;
         for (uint32_t x = 0; x < im->width; x++) {
-            color color = image_get(im, x, y);
-            uint8_t *p = buffer + (y * im->width + x) * 3;
-            p[0] = powf(color.p.r, inv) * 255;
-            p[1] = powf(color.p.g, inv) * 255;
-            p[2] = powf(color.p.b, inv) * 255;
+            bool occupied = image_occupied(im, x, y);
+            uint32_t v = im->levels[(size_t)y * im->width + x];
+            for (int c = 2; c >= 0; c--) {
+                uint32_t level = v >> (c * im->depth) & mask;
+                if (!wide) {
+                    *p++ = occupied ? im->bytes[level] : 0;
+                } else {
+                    uint16_t w = occupied ? im->words[level] : 0;
+                    *p++ = w >> 8;
+                    *p++ = w;
+                }
+            }
         }
+        fwrite(row, im->width, wide ? 6 : 3, out);
     }
-    fwrite(buffer, im->width * im->height, 3, out);
+    free(row);
     fflush(out);
-    free(buffer);
 }
 
 void
 image_free(const image *image)
 {
+    free(image->levels);
+    free(image->occupied);
+    free(image->values);
+    free(image->bytes);
+    free(image->words);
+    free(image->keys);
+    free(image->slots);
     free((void *)image);
 }
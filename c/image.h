@@ -1,29 +1,170 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
 #include "color.h"
 
+#define IMAGE_MAX_DEPTH 10
+
+/* Pixels are stored as their packed lattice index, r << 2d | g << d | b
+ * for depth d, plus an occupancy bitmap that neighbor checks use. The
+ * bitmap has a one-pixel border that is always occupied, so pixel
+ * (x, y) is bit x + 1 of padded row y + 1, and every pixel's neighbors
+ * can be read without bounds checks.
+ * Gamma-space colors and output samples are rebuilt from per-level
+ * tables on demand, so a pixel costs 4 bytes plus its bit, against 16
+ * bytes for a stored color.
+ *
+ * Every channel value of a colorset is one of 2^depth lattice levels,
+ * so a small hash table keyed on the float's bits maps a color back to
+ * its levels when it is placed.
+ */
 typedef struct image {
     uint32_t width;
     uint32_t height;
-    color pixels[];
+    int depth;
+    uint32_t *levels;   /* width * height packed level triples */
+    uint64_t *occupied; /* padded bitmap, one bit per pixel */
+    size_t stride;      /* 64-bit words per padded row */
+    float *values;      /* gamma-space value per level */
+    uint8_t *bytes;     /* 8-bit output per level */
+    uint16_t *words;    /* 16-bit output per level */
+    uint32_t *keys;     /* channel value bits, or IMAGE_EMPTY */
+    uint16_t *slots;    /* level for each key */
+    int shift;          /* 32 - log2 of table size */
 } image;
 
-image *image_create(uint32_t width, uint32_t height);
+#define IMAGE_EMPTY UINT32_C(0xffffffff)  /* a NaN, never a level */
+
+image *image_create(uint32_t width, uint32_t height, int depth, float gamma);
 void   image_free(const image *image);
-void   image_save(image *im, float gamma, FILE *out);
+void   image_save(const image *im, FILE *out);
+
+/* Bytes in the occupancy bitmap, border included. */
+static inline size_t
+image_occupied_size(const image *im)
+{
+    return im->stride * ((size_t)im->height + 2) * 8;
+}
+
+/* True for placed pixels and for anything outside the image. */
+static inline bool
+image_occupied(const image *im, uint32_t x, uint32_t y)
+{
+    if (x >= im->width || y >= im->height)
+        return true;
+    const uint64_t *row = im->occupied + ((size_t)y + 1) * im->stride;
+    size_t i = (size_t)x + 1;
+    return row[i / 64] >> (i % 64) & 1;
+}
+
+/* Three bits of a padded row starting at bit x. The following word is
+ * read only when the window straddles it, but without a branch.
+ */
+static inline uint32_t
+image_window(const uint64_t *row, uint32_t x)
+{
+    uint32_t s = x % 64;
+    uint64_t lo = row[x / 64] >> s;
+    uint64_t hi = row[x / 64 + (s > 61)] << (63 - s) << 1;
+    return (lo | hi) & 7;
+}
+
+/* The free neighbors of an in-bounds pixel as an 8-bit mask in
+ * row-major order, skipping the pixel itself. The three rows usually
+ * sit in three cache lines.
+ */
+static inline uint32_t
+image_neighbors(const image *im, uint32_t x, uint32_t y)
+{
+    const uint64_t *row = im->occupied + (size_t)y * im->stride;
+    uint32_t taken = image_window(row, x) |
+                     image_window(row + im->stride, x) << 3 |
+                     image_window(row + 2 * im->stride, x) << 6;
+    uint32_t free = ~taken & 0x1ef;
+    return (free & 0xf) | (free >> 1 & 0xf0);
+}
+
+/* True for a placed pixel with at least one free neighbor. */
+static inline bool
+image_frontier(const image *im, uint32_t x, uint32_t y)
+{
+    return image_occupied(im, x, y) && image_neighbors(im, x, y);
+}
+
+/* Offset to bit k of a neighbor mask, for k < popcount(mask). */
+static inline void
+image_neighbor(uint32_t mask, uint32_t k, int *dx, int *dy)
+{
+    /* Clear the k lowest bits without branching on k. */
+    for (uint32_t i = 0; i < 7; i++)
+        mask &= mask - (i < k);
+    int b = __builtin_ctz(mask);
+    int cell = b + (b >= 4);
+    *dx = cell % 3 - 1;
+    *dy = cell / 3 - 1;
+}
 
 static inline color
 image_get(const image *im, uint32_t x, uint32_t y)
 {
-    if (x < im->width && y < im->height)
-        return im->pixels[y * im->width + x];
-    else
+    if (x >= im->width || y >= im->height)
         return COLOR(0, 0, 0, 1);
+    if (!image_occupied(im, x, y))
+        return (color){{0, 0, 0, 0}};
+    uint32_t p = im->levels[(size_t)y * im->width + x];
+    uint32_t mask = (UINT32_C(1) << im->depth) - 1;
+    return (color){{
+        im->values[p >> (2 * im->depth)],
+        im->values[p >> im->depth & mask],
+        im->values[p & mask],
+        1.0f
+    }};
+}
+
+static inline uint32_t
+image_slot(const image *im, uint32_t key)
+{
+    return (key * UINT32_C(0x9e3779b1)) >> im->shift;
+}
+
+/* The lattice level of a channel value. */
+static inline uint32_t
+image_level(const image *im, float v)
+{
+    uint32_t key;
+    memcpy(&key, &v, sizeof(key));
+    uint32_t mask = (UINT32_C(0xffffffff) >> im->shift);
+    uint32_t i = image_slot(im, key);
+    while (im->keys[i] != key) {
+        assert(im->keys[i] != IMAGE_EMPTY);
+        i = (i + 1) & mask;
+    }
+    return im->slots[i];
+}
+
+/* The 8-bit output of a pixel, as written by image_save() at depth 8. */
+static inline void
+image_rgb(const image *im, uint32_t x, uint32_t y, uint8_t rgb[3])
+{
+    uint32_t p = im->levels[(size_t)y * im->width + x];
+    uint32_t mask = (UINT32_C(1) << im->depth) - 1;
+    rgb[0] = im->bytes[p >> (2 * im->depth)];
+    rgb[1] = im->bytes[p >> im->depth & mask];
+    rgb[2] = im->bytes[p & mask];
 }
 
 static inline void
 image_set(image *im, uint32_t x, uint32_t y, color color)
 {
-    im->pixels[y * im->width + x] = color;
+    uint32_t p = 0;
+    for (int c = 0; c < 3; c++)
+        p = p << im->depth | image_level(im, color.c[c]);
+    im->levels[(size_t)y * im->width + x] = p;
+    uint64_t *row = im->occupied + ((size_t)y + 1) * im->stride;
+    size_t b = (size_t)x + 1;
+    row[b / 64] |= UINT64_C(1) << (b % 64);
 }
@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "kdflat.h"
+
+static inline uint32_t
+kdflat_pack(uint32_t x, uint32_t y)
+{
+    assert(x <= KDFLAT_MAX_SIZE && y <= KDFLAT_MAX_SIZE);
+    return y << 16 | x;
+}
+
+/* Compare colors one channel at a time, starting at the given axis. */
+static int
+kdflat_cmp(uint32_t axis, const float *a, const float *b)
+{
+    for (int i = 0; i < 3; i++) {
+        uint32_t j = (axis + i) % 3;
+        if (a[j] != b[j])
+            return a[j] < b[j] ? -1 : 1;
+    }
+    return 0;
+}
+
+static uint32_t
+kdflat_leaf_alloc(kdflat *k)
+{
+    if (k->nleaves == k->maxleaves) {
+        k->maxleaves *= 2;
+        k->leaves = realloc(k->leaves, k->maxleaves * sizeof(k->leaves[0]));
+    }
+    return k->nleaves++;
+}
+
+static uint32_t
+kdflat_node_alloc(kdflat *k, uint32_t axis)
+{
+    if (k->nnodes == k->maxnodes) {
+        k->maxnodes *= 2;
+        k->nodes = realloc(k->nodes, k->maxnodes * sizeof(k->nodes[0]));
+    }
+    kdflat_node *n = k->nodes + k->nnodes;
+    n->axis = axis;
+    n->count = 0;
+    n->child = KDFLAT_NONE;
+    n->leaf = KDFLAT_NONE;
+    return k->nnodes++;
+}
+
+static void
+kdflat_leaf_push(kdflat *k, uint32_t leaf, uint32_t i,
+                 const float *c, uint32_t xy)
+{
+    kdflat_leaf *l = k->leaves + leaf;
+    handles_set(k->handles, xy & 0xffff, xy >> 16,
+                leaf * KDFLAT_THRESHOLD + i);
+    l->r[i] = c[0];
+    l->g[i] = c[1];
+    l->b[i] = c[2];
+    l->xy[i] = xy;
+}
+
+/* Turn a full leaf into an internal node with two half-full leaves. */
+static void
+kdflat_split(kdflat *k, uint32_t node)
+{
+    struct {
+        float c[3];
+        uint32_t xy;
+    } tmp[KDFLAT_THRESHOLD];
+    STATS_START();
+    kdflat_node *n = k->nodes + node;
+    uint32_t axis = n->axis;
+    uint32_t count = n->count;
+    uint32_t leaf = n->leaf;
+    kdflat_leaf *l = k->leaves + leaf;
+
+    /* Insertion sort is plenty for a single leaf. */
+    for (uint32_t i = 0; i < count; i++) {
+        float c[3] = {l->r[i], l->g[i], l->b[i]};
+        uint32_t j = i;
+        for (; j > 0 && kdflat_cmp(axis, c, tmp[j - 1].c) < 0; j--)
+            tmp[j] = tmp[j - 1];
+        tmp[j].c[0] = c[0];
+        tmp[j].c[1] = c[1];
+        tmp[j].c[2] = c[2];
+        tmp[j].xy = l->xy[i];
+    }
+
+    uint32_t next = (axis + 1) % 3;
+    uint32_t left = kdflat_node_alloc(k, next);
+    uint32_t right = kdflat_node_alloc(k, next);
+    assert(right == left + 1);
+    uint32_t rleaf = kdflat_leaf_alloc(k);
+    n = k->nodes + node;
+    n->child = left;
+    n->leaf = KDFLAT_NONE;
+    for (int i = 0; i < 3; i++)
+        n->median[i] = tmp[count / 2].c[i];
+    k->nodes[left].leaf = leaf;
+    k->nodes[right].leaf = rleaf;
+
+    for (uint32_t i = 0; i < count; i++) {
+        kdflat_node *c = k->nodes + (i <= count / 2 ? left : right);
+        kdflat_leaf_push(k, c->leaf, c->count++, tmp[i].c, tmp[i].xy);
+    }
+    STATS_STOP(STAT_SPLIT, 1);
+}
+
+static bool
+kdflat_add(kdflat *k, edge e)
+{
+    uint32_t node = 0;
+    for (;;) {
+        kdflat_node *n = k->nodes + node;
+        if (n->leaf == KDFLAT_NONE) {
+            n->count++;
+            node = n->child + (kdflat_cmp(n->axis, e.color.c, n->median) > 0);
+        } else if (n->count == KDFLAT_THRESHOLD) {
+            kdflat_split(k, node);
+        } else {
+            uint32_t xy = kdflat_pack(e.x, e.y);
+            kdflat_leaf_push(k, n->leaf, n->count++, e.color.c, xy);
+            return true;
+        }
+    }
+}
+
+static bool
+kdflat_remove(kdflat *k, edge e)
+{
+    uint32_t slot = handles_get(k->handles, e.x, e.y);
+    if (slot == HANDLE_NONE)
+        return false;
+    uint32_t leaf = slot / KDFLAT_THRESHOLD;
+    uint32_t i = slot % KDFLAT_THRESHOLD;
+    kdflat_leaf *l = k->leaves + leaf;
+    if (leaf >= k->nleaves || l->xy[i] != kdflat_pack(e.x, e.y))
+        return false;
+
+    /* The walk down only updates counts; the slot is already known. */
+    uint32_t node = 0;
+    while (k->nodes[node].leaf == KDFLAT_NONE) {
+        kdflat_node *n = k->nodes + node;
+        n->count--;
+        node = n->child + (kdflat_cmp(n->axis, e.color.c, n->median) > 0);
+    }
+    kdflat_node *n = k->nodes + node;
+    assert(n->leaf == leaf && i < n->count);
+    handles_set(k->handles, e.x, e.y, HANDLE_NONE);
+    uint32_t last = --n->count;
+    if (i != last) {
+        float c[3] = {l->r[last], l->g[last], l->b[last]};
+        kdflat_leaf_push(k, leaf, i, c, l->xy[last]);
+    }
+    return true;
+}
+
+struct kdflat_best {
+    float dist2;
+    uint32_t xy;
+    float c[3];
+};
+
+static void
+kdflat_scan(const kdflat_leaf *l, uint32_t count, color c,
+            struct kdflat_best *best)
+{
+    float dist2[KDFLAT_THRESHOLD];
+    STATS_ADD(STAT_SCANNED, count);
+    for (uint32_t i = 0; i < count; i++) {
+        float dr = c.p.r - l->r[i];
+        float dg = c.p.g - l->g[i];
+        float db = c.p.b - l->b[i];
+        dist2[i] = dr * dr + dg * dg + db * db;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        float d = dist2[i];
+        if (d < best->dist2 || (d == best->dist2 && l->xy[i] < best->xy)) {
+            best->dist2 = d;
+            best->xy = l->xy[i];
+            best->c[0] = l->r[i];
+            best->c[1] = l->g[i];
+            best->c[2] = l->b[i];
+        }
+    }
+}
+
+static void
+kdflat_nearest(const kdflat *k, uint32_t node, color c,
+               struct kdflat_best *best, float slack)
+{
+    const kdflat_node *n = k->nodes + node;
+    if (n->leaf != KDFLAT_NONE) {
+        kdflat_scan(k->leaves + n->leaf, n->count, c, best);
+    } else if (n->count > 0) {
+        int side = kdflat_cmp(n->axis, c.c, n->median) > 0;
+        kdflat_nearest(k, n->child + side, c, best, slack);
+        /* Everything on the far side lies beyond the splitting plane. */
+        float plane = c.c[n->axis] - n->median[n->axis];
+        if (plane * plane * slack <= best->dist2)
+            kdflat_nearest(k, n->child + !side, c, best, slack);
+    }
+}
+
+static void
+kdflat_scan_k(const kdflat_leaf *l, uint32_t count, color c,
+              nearest_set *set)
+{
+    float dist2[KDFLAT_THRESHOLD];
+    STATS_ADD(STAT_SCANNED, count);
+    for (uint32_t i = 0; i < count; i++) {
+        float dr = c.p.r - l->r[i];
+        float dg = c.p.g - l->g[i];
+        float db = c.p.b - l->b[i];
+        dist2[i] = dr * dr + dg * dg + db * db;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (dist2[i] <= nearest_bound(set)) {
+            edge e = {
+                l->xy[i] & 0xffff,
+                l->xy[i] >> 16,
+                {{l->r[i], l->g[i], l->b[i], 1.0f}}
+            };
+            nearest_insert(set, dist2[i], e);
+        }
+    }
+}
+
+static void
+kdflat_nearest_k(const kdflat *k, uint32_t node, color c, nearest_set *set)
+{
+    const kdflat_node *n = k->nodes + node;
+    if (n->leaf != KDFLAT_NONE) {
+        kdflat_scan_k(k->leaves + n->leaf, n->count, c, set);
+    } else if (n->count > 0) {
+        int side = kdflat_cmp(n->axis, c.c, n->median) > 0;
+        kdflat_nearest_k(k, n->child + side, c, set);
+        float plane = c.c[n->axis] - n->median[n->axis];
+        if (plane * plane <= nearest_bound(set))
+            kdflat_nearest_k(k, n->child + !side, c, set);
+    }
+}
+
+static bool
+method_add(finder *f, edge e)
+{
+    return kdflat_add((kdflat *)f, e);
+}
+
+static bool
+method_remove(finder *f, edge e)
+{
+    return kdflat_remove((kdflat *)f, e);
+}
+
+static float
+method_nearest_from(const finder *f, color c, edge *e)
+{
+    const kdflat *k = (const kdflat *)f;
+    struct kdflat_best best = {INFINITY, UINT32_MAX, {0, 0, 0}};
+    if (handles_get(k->handles, e->x, e->y) != HANDLE_NONE) {
+        best.dist2 = color_dist2(c, e->color);
+        best.xy = kdflat_pack(e->x, e->y);
+        for (int i = 0; i < 3; i++)
+            best.c[i] = e->color.c[i];
+    }
+    kdflat_nearest(k, 0, c, &best, f->slack);
+    if (isfinite(best.dist2)) {
+        e->x = best.xy & 0xffff;
+        e->y = best.xy >> 16;
+        e->color = (color){{best.c[0], best.c[1], best.c[2], 1.0f}};
+    }
+    return sqrtf(best.dist2);
+}
+
+static float
+method_nearest(const finder *f, color c, edge *e)
+{
+    *e = EDGE_NONE;
+    return method_nearest_from(f, c, e);
+}
+
+static void
+method_nearest_k(const finder *f, color c, nearest_set *set)
+{
+    kdflat_nearest_k((const kdflat *)f, 0, c, set);
+}
+
+static void
+method_free(const finder *f)
+{
+    kdflat *k = (kdflat *)f;
+    free(k->leaves);
+    free(k->nodes);
+    handles_free(k->handles);
+    free(k);
+}
+
+#if FINDER_STATIC == FINDER_KDFLAT
+FINDER_STATIC_DEFINE()
+#endif
+
+finder *
+kdflat_create(uint32_t width, uint32_t height)
+{
+    kdflat *k = malloc(sizeof(*k));
+    k->handles = handles_create(width, height);
+    k->maxnodes = 1024;
+    k->nnodes = 0;
+    k->nodes = malloc(k->maxnodes * sizeof(k->nodes[0]));
+    k->maxleaves = 512;
+    k->nleaves = 0;
+    k->leaves = malloc(k->maxleaves * sizeof(k->leaves[0]));
+    uint32_t root = kdflat_node_alloc(k, 0);
+    k->nodes[root].leaf = kdflat_leaf_alloc(k);
+    k->finder.add = method_add;
+    k->finder.remove = method_remove;
+    k->finder.nearest = method_nearest;
+    k->finder.nearest_from = method_nearest_from;
+    k->finder.nearest_k = method_nearest_k;
+    k->finder.free = method_free;
+    k->finder.slack = 1.0f;
+    return &k->finder;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include "finder.h"
+#include "handles.h"
+
+#define KDFLAT_THRESHOLD 64
+#define KDFLAT_NONE      UINT32_MAX
+#define KDFLAT_MAX_SIZE  0xffff  /* positions are packed as y << 16 | x */
+
+/* A kd-tree whose nodes live in one array and refer to each other by
+ * index. Leaf contents are kept apart from the nodes as separate color
+ * channel arrays so that scanning a leaf is a few contiguous streams.
+ */
+typedef struct kdflat_node {
+    float median[3];
+    uint32_t axis;
+    uint32_t count;
+    uint32_t child;  /* left child, right is child + 1 */
+    uint32_t leaf;   /* index into leaves, or KDFLAT_NONE */
+} kdflat_node;
+
+typedef struct kdflat_leaf {
+    float r[KDFLAT_THRESHOLD];
+    float g[KDFLAT_THRESHOLD];
+    float b[KDFLAT_THRESHOLD];
+    uint32_t xy[KDFLAT_THRESHOLD];  /* y << 16 | x */
+} kdflat_leaf;
+
+typedef struct kdflat {
+    finder finder;
+    kdflat_node *nodes;
+    kdflat_leaf *leaves;
+    uint32_t nnodes, maxnodes;
+    uint32_t nleaves, maxleaves;
+    handles *handles;  /* leaf * KDFLAT_THRESHOLD + position */
+} kdflat;
+
+finder *kdflat_create(uint32_t width, uint32_t height);
@@ -1,6 +1,15 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "kdtree.h"
+#include "scan.h"
+
+/* A subtree is rebuilt once one side holds more than 3/4 of its edges,
+ * but only when it is large enough for the imbalance to matter. Leaves
+ * merge back into their parent when it drops to half a leaf.
+ */
+#define KDTREE_REBUILD_MIN (4 * KDTREE_THRESHOLD)
+#define KDTREE_MERGE       (KDTREE_THRESHOLD / 2)
 
 static inline bool
 kdtree_is_leaf(const kdtree *k)
@@ -8,16 +17,100 @@ kdtree_is_leaf(const kdtree *k)
     return k->left == NULL;
 }
 
+static void
+kdtree_bound_clear(kdtree *k)
+{
+    for (int i = 0; i < 3; i++) {
+        k->bound[0].c[i] = INFINITY;
+        k->bound[1].c[i] = -INFINITY;
+    }
+}
+
+/* Stretch the box of k over c, returning true if it changed. */
+static bool
+kdtree_bound_grow(kdtree *k, color c)
+{
+    bool grew = false;
+    for (int i = 0; i < 3; i++) {
+        if (c.c[i] < k->bound[0].c[i]) {
+            k->bound[0].c[i] = c.c[i];
+            grew = true;
+        }
+        if (c.c[i] > k->bound[1].c[i]) {
+            k->bound[1].c[i] = c.c[i];
+            grew = true;
+        }
+    }
+    return grew;
+}
+
+/* Recompute the box of k from its edges or from its children. */
+static void
+kdtree_bound_update(kdtree *k)
+{
+    kdtree_bound_clear(k);
+    if (kdtree_is_leaf(k)) {
+        for (long i = 0; i < k->count; i++)
+            kdtree_bound_grow(k, k->edges[i].color);
+    } else {
+        /* An empty child's inverted box would stretch this one. */
+        const kdtree *child[] = {k->left, k->right};
+        for (int i = 0; i < 2; i++) {
+            if (child[i]->count > 0) {
+                kdtree_bound_grow(k, child[i]->bound[0]);
+                kdtree_bound_grow(k, child[i]->bound[1]);
+            }
+        }
+    }
+}
+
+/* Recompute the box of k, returning true if it changed. */
+static bool
+kdtree_bound_refit(kdtree *k)
+{
+    color old[2] = {k->bound[0], k->bound[1]};
+    kdtree_bound_update(k);
+    return memcmp(old, k->bound, sizeof(old)) != 0;
+}
+
+/* Squared distance from c to the box of k, summed like color_dist2()
+ * so that it never exceeds the distance to any edge inside.
+ */
+static inline float
+kdtree_box_dist2(const kdtree *k, color c)
+{
+    if (k->count == 0)
+        return INFINITY;
+    color closest = c;
+    for (int i = 0; i < 3; i++) {
+        if (closest.c[i] < k->bound[0].c[i])
+            closest.c[i] = k->bound[0].c[i];
+        else if (closest.c[i] > k->bound[1].c[i])
+            closest.c[i] = k->bound[1].c[i];
+    }
+    return color_dist2(c, closest);
+}
+
 static kdtree *
-kdtree_subcreate(enum kdtree_axis axis)
+kdtree_subcreate(enum kdtree_axis axis, handles *handles)
 {
     kdtree *k = malloc(sizeof(*k));
     k->axis = axis;
     k->left = k->right = NULL;
     k->count = 0;
+    kdtree_bound_clear(k);
+    k->handles = handles;
     return k;
 }
 
+/* Point the handle of every edge in leaf k at its position. */
+static void
+kdtree_claim(kdtree *k)
+{
+    for (long i = 0; i < k->count; i++)
+        handles_set(k->handles, k->edges[i].x, k->edges[i].y, i);
+}
+
 static int
 edge_cmp(enum kdtree_axis a, const edge *restrict e0, const edge *restrict e1)
 {
@@ -63,96 +156,201 @@ cmpz(const void *a, const void *b)
 
 static int (*cmp[])(const void *a, const void *b) = {cmpx, cmpy, cmpz};
 
-static bool kdtree_add(kdtree *k, edge e);
+static bool kdtree_add(kdtree *k, edge e, kdtree **scapegoat);
 
 static void
 kstree_split(kdtree *k)
 {
+    STATS_START();
     qsort(k->edges, k->count, sizeof(k->edges[0]), cmp[k->axis]);
     enum kdtree_axis axis = (k->axis + 1) % 3;
-    k->left = kdtree_subcreate(axis);
-    k->right = kdtree_subcreate(axis);
+    k->left = kdtree_subcreate(axis, k->handles);
+    k->right = kdtree_subcreate(axis, k->handles);
     for (long i = 0; i < k->count; i++) {
         if (i <= k->count / 2)
-            kdtree_add(k->left, k->edges[i]);
+            kdtree_add(k->left, k->edges[i], NULL);
         else
-            kdtree_add(k->right, k->edges[i]);
+            kdtree_add(k->right, k->edges[i], NULL);
     }
     k->edges[0] = k->edges[k->count / 2];
+    STATS_STOP(STAT_SPLIT, 1);
+}
+
+/* Move every edge below k into out and release its subtrees. */
+static long
+kdtree_gather(kdtree *k, edge *out)
+{
+    if (kdtree_is_leaf(k)) {
+        memmove(out, k->edges, k->count * sizeof(out[0]));
+        return k->count;
+    }
+    long n = kdtree_gather(k->left, out);
+    n += kdtree_gather(k->right, out + n);
+    free(k->left);
+    free(k->right);
+    k->left = k->right = NULL;
+    return n;
+}
+
+static void
+kdtree_merge(kdtree *k)
+{
+    STATS_START();
+    long count = kdtree_gather(k, k->edges);
+    assert(count == k->count);
+    (void)count;
+    kdtree_claim(k);
+    kdtree_bound_update(k);
+    STATS_STOP(STAT_COALESCE, 1);
+}
+
+/* Build a balanced subtree at k from scratch. */
+static void
+kdtree_build(kdtree *k, edge *edges, long n)
+{
+    k->count = n;
+    if (n <= KDTREE_MERGE) {
+        memcpy(k->edges, edges, n * sizeof(edges[0]));
+        kdtree_claim(k);
+        kdtree_bound_update(k);
+        return;
+    }
+    qsort(edges, n, sizeof(edges[0]), cmp[k->axis]);
+    enum kdtree_axis axis = (k->axis + 1) % 3;
+    k->left = kdtree_subcreate(axis, k->handles);
+    k->right = kdtree_subcreate(axis, k->handles);
+    k->edges[0] = edges[n / 2];
+    kdtree_build(k->left, edges, n / 2 + 1);
+    kdtree_build(k->right, edges + n / 2 + 1, n - n / 2 - 1);
+    kdtree_bound_update(k);
+}
+
+static void
+kdtree_rebuild(kdtree *k)
+{
+    STATS_START();
+    edge *edges = malloc(k->count * sizeof(edges[0]));
+    long count = kdtree_gather(k, edges);
+    kdtree_build(k, edges, count);
+    free(edges);
+    STATS_STOP(STAT_REBUILD, 1);
+}
+
+static bool
+kdtree_unbalanced(const kdtree *k)
+{
+    long heavy = k->left->count > k->right->count ?
+        k->left->count : k->right->count;
+    return k->count >= KDTREE_REBUILD_MIN && heavy * 4 > k->count * 3;
 }
 
+/* Adding or removing an edge records the highest node along its path
+ * that has fallen out of balance, which the caller then rebuilds.
+ *
+ * Adding grows boxes on the way back up. A box holds its children's,
+ * so once one is unchanged, none above it can change either. Adding
+ * returns true if the box of k grew. Removing tightens boxes only
+ * where it is cheap: a leaf that empties drops its box, a merged node
+ * refits to its edges, and each such change refits the parents above
+ * it from their children, setting *shrunk. Any other box stays loose,
+ * which only prunes less, until a merge or rebuild.
+ */
 static bool
-kdtree_add(kdtree *k, edge e)
+kdtree_add(kdtree *k, edge e, kdtree **scapegoat)
 {
     if (!kdtree_is_leaf(k)) {
         int result = edge_cmp(k->axis, &e, &k->edges[0]);
         k->count++;
-        bool added = kdtree_add(result <= 0 ? k->left : k->right, e);
-        assert(added);
-        return added;
+        kdtree *next = result <= 0 ? k->left : k->right;
+        bool grew = kdtree_add(next, e, scapegoat) &&
+                    kdtree_bound_grow(k, e.color);
+        if (scapegoat && kdtree_unbalanced(k))
+            *scapegoat = k;
+        return grew;
     } else if (k->count == KDTREE_THRESHOLD) {
         kstree_split(k);
-        return kdtree_add(k, e);
+        return kdtree_add(k, e, scapegoat);
     } else {
         assert(k->count < KDTREE_THRESHOLD);
+        handles_set(k->handles, e.x, e.y, k->count);
         k->edges[k->count++] = e;
-        return true;
+        return kdtree_bound_grow(k, e.color);
     }
 }
 
 static bool
-kdtree_remove(kdtree *k, edge e)
+kdtree_remove(kdtree *k, edge e, kdtree **scapegoat, bool *shrunk)
 {
     if (!kdtree_is_leaf(k)) {
         int result = edge_cmp(k->axis, &e, &k->edges[0]);
         k->count--;
-        bool removed = kdtree_remove(result <= 0 ? k->left : k->right, e);
+        kdtree *next = result <= 0 ? k->left : k->right;
+        bool removed = kdtree_remove(next, e, scapegoat, shrunk);
         assert(removed);
+        if (k->count <= KDTREE_MERGE) {
+            kdtree_merge(k);
+            *shrunk = true;
+        } else {
+            if (*shrunk)
+                *shrunk = kdtree_bound_refit(k);
+            if (kdtree_unbalanced(k))
+                *scapegoat = k;
+        }
         return removed;
     } else {
-        assert(k->count <= KDTREE_THRESHOLD);
-        for (long i = 0; i < k->count; i++) {
-            if (e.x == k->edges[i].x && e.y == k->edges[i].y) {
-                k->edges[i] = k->edges[--k->count];
-                return true;
-            }
+        long i = handles_get(k->handles, e.x, e.y);
+        if (i >= k->count || k->edges[i].x != e.x || k->edges[i].y != e.y)
+            return false;
+        handles_set(k->handles, e.x, e.y, HANDLE_NONE);
+        k->edges[i] = k->edges[--k->count];
+        if (i < k->count)
+            handles_set(k->handles, k->edges[i].x, k->edges[i].y, i);
+        if (k->count == 0) {
+            kdtree_bound_clear(k);
+            *shrunk = true;
         }
-        return false;
+        return true;
     }
 }
 
+/* The far side is skipped unless it could beat best2 by the slack. The
+ * splitting plane is a cheap first test, and the far side's box, which
+ * is never looser, is checked only when the plane passes.
+ */
 static float
-kdtree_nearest(const kdtree *k, color c, edge *e)
+kdtree_nearest(const kdtree *k, color c, edge *e, float best2, float slack)
 {
     if (!kdtree_is_leaf(k)) {
-        color median = k->edges[0].color;
-        int result = edge_cmp(k->axis, &(edge){0, 0, c}, &k->edges[0]);
-        kdtree *k0 = result <= 0 ? k->left : k->right;
-        float dist0 = kdtree_nearest(k0, c, e);
-        float median_dist = fabsf(e->color.c[k->axis] - median.c[k->axis]);
-        if (dist0 >= median_dist) {
-            kdtree *k1 = result <= 0 ? k->right : k->left;
-            edge candidate;
-            float dist1 = kdtree_nearest(k1, c, &candidate);
-            if (dist1 < dist0) {
-                *e = candidate;
-                return dist1;
-            }
-        }
-        return dist0;
-    } else if (k->count == 0) {
-        return INFINITY;
+        const edge *median = &k->edges[0];
+        int result = edge_cmp(k->axis, &(edge){0, 0, c}, median);
+        const kdtree *k0 = result <= 0 ? k->left : k->right;
+        const kdtree *k1 = result <= 0 ? k->right : k->left;
+        best2 = kdtree_nearest(k0, c, e, best2, slack);
+        float plane = c.c[k->axis] - median->color.c[k->axis];
+        if (plane * plane * slack <= best2 &&
+            kdtree_box_dist2(k1, c) * slack <= best2)
+            best2 = kdtree_nearest(k1, c, e, best2, slack);
+        return best2;
     } else {
-        *e = k->edges[0];
-        float best2 = color_dist2(c, e->color);
-        for (long i = 1; i < k->count; i++) {
-            float dist2 = color_dist2(c, k->edges[i].color);
-            if (dist2 < best2) {
-                best2 = dist2;
-                *e = k->edges[i];
-            }
-        }
-        return sqrt(best2);
+        return scan_closest(k->edges, k->count, c, e, best2);
+    }
+}
+
+static void
+kdtree_nearest_k(const kdtree *k, color c, nearest_set *set)
+{
+    if (!kdtree_is_leaf(k)) {
+        const edge *median = &k->edges[0];
+        int result = edge_cmp(k->axis, &(edge){0, 0, c}, median);
+        const kdtree *k0 = result <= 0 ? k->left : k->right;
+        const kdtree *k1 = result <= 0 ? k->right : k->left;
+        kdtree_nearest_k(k0, c, set);
+        float plane = c.c[k->axis] - median->color.c[k->axis];
+        if (plane * plane <= nearest_bound(set) &&
+            kdtree_box_dist2(k1, c) <= nearest_bound(set))
+            kdtree_nearest_k(k1, c, set);
+    } else {
+        scan_closest_k(k->edges, k->count, c, set);
     }
 }
 
@@ -160,41 +358,104 @@ static bool
 method_add(finder *f, edge e)
 {
     kdtree *k = (kdtree *)f;
-    return kdtree_add(k, e);
+    kdtree *scapegoat = NULL;
+    kdtree_add(k, e, &scapegoat);
+    if (scapegoat)
+        kdtree_rebuild(scapegoat);
+    return true;
 }
 
 static bool
 method_remove(finder *f, edge e)
 {
     kdtree *k = (kdtree *)f;
-    return kdtree_remove(k, e);
+    if (handles_get(k->handles, e.x, e.y) == HANDLE_NONE)
+        return false;
+    kdtree *scapegoat = NULL;
+    bool shrunk = false;
+    bool removed = kdtree_remove(k, e, &scapegoat, &shrunk);
+    if (scapegoat)
+        kdtree_rebuild(scapegoat);
+    return removed;
 }
 
 static float
 method_nearest(const finder *f, color c, edge *e)
 {
     const kdtree *k = (const kdtree *)f;
-    return kdtree_nearest(k, c, e);
+    return sqrtf(kdtree_nearest(k, c, e, INFINITY, f->slack));
+}
+
+static float
+method_nearest_from(const finder *f, color c, edge *e)
+{
+    const kdtree *k = (const kdtree *)f;
+    float best2 = INFINITY;
+    if (handles_get(k->handles, e->x, e->y) != HANDLE_NONE)
+        best2 = color_dist2(c, e->color);
+    return sqrtf(kdtree_nearest(k, c, e, best2, f->slack));
 }
 
 static void
-method_free(const finder *f)
+method_nearest_k(const finder *f, color c, nearest_set *set)
+{
+    kdtree_nearest_k((const kdtree *)f, c, set);
+}
+
+static void
+kdtree_free(kdtree *k)
 {
-    kdtree *k = (kdtree *)f;
     if (!kdtree_is_leaf(k)) {
-        method_free(&k->left->finder);
-        method_free(&k->right->finder);
+        kdtree_free(k->left);
+        kdtree_free(k->right);
     }
     free(k);
 }
 
+static void
+method_free(const finder *f)
+{
+    kdtree *k = (kdtree *)f;
+    handles_free(k->handles);
+    kdtree_free(k);
+}
+
+#if FINDER_STATIC == FINDER_KDTREE
+FINDER_STATIC_DEFINE()
+#endif
+
+static void
+kdtree_walk(const kdtree *k, int depth, kdtree_shape *shape)
+{
+    if (depth > shape->depth)
+        shape->depth = depth;
+    if (kdtree_is_leaf(k)) {
+        shape->leaves++;
+        shape->empty += k->count == 0;
+    } else {
+        kdtree_walk(k->left, depth + 1, shape);
+        kdtree_walk(k->right, depth + 1, shape);
+    }
+}
+
+kdtree_shape
+kdtree_measure(const finder *f)
+{
+    kdtree_shape shape = {0, 0, 0};
+    kdtree_walk((const kdtree *)f, 0, &shape);
+    return shape;
+}
+
 finder *
-kdtree_create(void)
+kdtree_create(uint32_t width, uint32_t height)
 {
-    kdtree *k = kdtree_subcreate(KDTREE_X);
+    kdtree *k = kdtree_subcreate(KDTREE_X, handles_create(width, height));
     k->finder.add = method_add;
     k->finder.remove = method_remove;
     k->finder.nearest = method_nearest;
+    k->finder.nearest_from = method_nearest_from;
+    k->finder.nearest_k = method_nearest_k;
     k->finder.free = method_free;
+    k->finder.slack = 1.0f;
     return &k->finder;
 }
@@ -1,4 +1,5 @@
 #include "finder.h"
+#include "handles.h"
 
 #define KDTREE_THRESHOLD 64
 
@@ -9,7 +10,15 @@ typedef struct kdtree {
     enum kdtree_axis axis;
     struct kdtree *left, *right;
     long count;
+    color bound[2];    /* box around the subtree, may be loose */
+    handles *handles;  /* position within a leaf, shared by all nodes */
     edge edges[KDTREE_THRESHOLD];
 } kdtree;
 
-finder *kdtree_create(void);
+typedef struct kdtree_shape {
+    int depth;
+    long leaves, empty;
+} kdtree_shape;
+
+finder      *kdtree_create(uint32_t width, uint32_t height);
+kdtree_shape kdtree_measure(const finder *);
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "lattice.h"
+#include "colorset.h"
+
+static uint32_t
+lattice_spread(uint32_t v)
+{
+    uint32_t m = 0;
+    for (int i = 0; i < LATTICE_MAX_DEPTH; i++)
+        m |= (v >> i & 1) << (3 * i);
+    return m;
+}
+
+
+/* Find the level with exactly this gamma-space value. */
+static uint32_t
+lattice_level(const lattice *l, float v)
+{
+    uint32_t lo = 0;
+    uint32_t hi = UINT32_C(1) << l->depth;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (l->values[mid] < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    assert(lo < UINT32_C(1) << l->depth && l->values[lo] == v);
+    return lo;
+}
+
+static uint32_t
+lattice_cell(const lattice *l, color c)
+{
+    uint32_t r = lattice_level(l, c.p.r);
+    uint32_t g = lattice_level(l, c.p.g);
+    uint32_t b = lattice_level(l, c.p.b);
+    return l->spread[r] << 2 | l->spread[g] << 1 | l->spread[b];
+}
+
+static inline bool
+lattice_test(const uint8_t *bits, uint32_t i)
+{
+    return bits[i >> 3] >> (i & 7) & 1;
+}
+
+static bool
+lattice_add(lattice *l, edge e)
+{
+    assert(e.x <= LATTICE_MAX_SIZE && e.y <= LATTICE_MAX_SIZE);
+    uint32_t m = lattice_cell(l, e.color);
+    assert(!lattice_test(l->bits[0], m));
+    l->cells[m] = e.y << 16 | e.x;
+    for (int level = 0; level < l->depth; level++, m >>= 3) {
+        bool was_set = l->bits[level][m >> 3];
+        l->bits[level][m >> 3] |= 1u << (m & 7);
+        if (was_set)
+            break;
+    }
+    l->count++;
+    return true;
+}
+
+static bool
+lattice_remove(lattice *l, edge e)
+{
+    uint32_t m = lattice_cell(l, e.color);
+    if (!lattice_test(l->bits[0], m) || l->cells[m] != (e.y << 16 | e.x))
+        return false;
+    /* Clear upwards until a block still has other children. */
+    for (int level = 0; level < l->depth; level++, m >>= 3) {
+        l->bits[level][m >> 3] &= ~(1u << (m & 7));
+        if (l->bits[level][m >> 3])
+            break;
+    }
+    l->count--;
+    return true;
+}
+
+/* Squared distance along one axis from t to a block spanning levels
+ * lo..hi. Summing three of these rounds exactly like color_dist2().
+ */
+static inline float
+lattice_axis_dist2(const lattice *l, float t, uint32_t lo, uint32_t hi)
+{
+    float d = 0.0f;
+    if (t < l->values[lo])
+        d = t - l->values[lo];
+    else if (t > l->values[hi])
+        d = t - l->values[hi];
+    return d * d;
+}
+
+/* Search the children of the block at the given level, nearest first. */
+static void
+lattice_search(const lattice *l, int level, uint32_t m, const uint32_t c[3],
+               color target, nearest_set *set)
+{
+    /* Each child is one of two halves along each axis. */
+    int shift = level - 1;
+    float axis[3][2];
+    for (int i = 0; i < 3; i++) {
+        for (uint32_t j = 0; j < 2; j++) {
+            uint32_t lo = (c[i] << 1 | j) << shift;
+            uint32_t hi = lo + (UINT32_C(1) << shift) - 1;
+            axis[i][j] = lattice_axis_dist2(l, target.c[i], lo, hi);
+        }
+    }
+
+    struct {
+        float dist2;
+        uint32_t k;
+    } order[8];
+    int n = 0;
+    unsigned bits = l->bits[level - 1][m];
+    while (bits) {
+        uint32_t k = __builtin_ctz(bits);
+        bits &= bits - 1;
+        float dist2 = axis[0][k >> 2] + axis[1][k >> 1 & 1] + axis[2][k & 1];
+        if (dist2 > nearest_bound(set))
+            continue;
+        if (shift == 0) {
+            /* A single cell: the box distance is the edge distance. */
+            uint32_t xy = l->cells[m << 3 | k];
+            edge e = {xy & 0xffff, xy >> 16, {{
+                l->values[c[0] << 1 | k >> 2],
+                l->values[c[1] << 1 | (k >> 1 & 1)],
+                l->values[c[2] << 1 | (k & 1)],
+                1.0f
+            }}};
+            nearest_insert(set, dist2, e);
+            continue;
+        }
+        int i = n++;
+        for (; i > 0 && order[i - 1].dist2 > dist2; i--)
+            order[i] = order[i - 1];
+        order[i].dist2 = dist2;
+        order[i].k = k;
+    }
+    for (int i = 0; i < n && order[i].dist2 <= nearest_bound(set); i++) {
+        uint32_t k = order[i].k;
+        uint32_t child[3] = {
+            c[0] << 1 | k >> 2,
+            c[1] << 1 | (k >> 1 & 1),
+            c[2] << 1 | (k & 1),
+        };
+        lattice_search(l, level - 1, m << 3 | k, child, target, set);
+    }
+}
+
+static void
+lattice_nearest_k(const lattice *l, color target, nearest_set *set)
+{
+    static const uint32_t origin[3] = {0, 0, 0};
+    if (l->count > 0)
+        lattice_search(l, l->depth, 0, origin, target, set);
+}
+
+static bool
+method_add(finder *f, edge e)
+{
+    return lattice_add((lattice *)f, e);
+}
+
+static bool
+method_remove(finder *f, edge e)
+{
+    return lattice_remove((lattice *)f, e);
+}
+
+static float
+method_nearest(const finder *f, color c, edge *e)
+{
+    float dist2;
+    nearest_set set = {1, 0, &dist2, e};
+    lattice_nearest_k((const lattice *)f, c, &set);
+    return set.count ? sqrtf(dist2) : INFINITY;
+}
+
+static float
+method_nearest_from(const finder *f, color c, edge *e)
+{
+    const lattice *l = (const lattice *)f;
+    float dist2;
+    nearest_set set = {1, 0, &dist2, e};
+    if (e->x != UINT32_MAX) {
+        uint32_t m = lattice_cell(l, e->color);
+        uint32_t xy = e->y << 16 | e->x;
+        if (lattice_test(l->bits[0], m) && l->cells[m] == xy) {
+            dist2 = color_dist2(c, e->color);
+            set.count = 1;
+        }
+    }
+    lattice_nearest_k(l, c, &set);
+    return set.count ? sqrtf(dist2) : INFINITY;
+}
+
+static void
+method_nearest_k(const finder *f, color c, nearest_set *set)
+{
+    lattice_nearest_k((const lattice *)f, c, set);
+}
+
+static void
+method_free(const finder *f)
+{
+    lattice *l = (lattice *)f;
+    free(l->cells);
+    free(l->bits[0]);
+    free(l->values);
+    free(l->spread);
+    free(l);
+}
+
+#if FINDER_STATIC == FINDER_LATTICE
+FINDER_STATIC_DEFINE()
+#endif
+
+finder *
+lattice_create(int depth, float gamma)
+{
+    assert(depth > 0 && depth <= LATTICE_MAX_DEPTH);
+    lattice *l = malloc(sizeof(*l));
+    l->depth = depth;
+    l->count = 0;
+
+    int levels = 1 << depth;
+    l->values = malloc(levels * sizeof(l->values[0]));
+    l->spread = malloc(levels * sizeof(l->spread[0]));
+    for (int i = 0; i < levels; i++) {
+        l->values[i] = colorset_level(depth, gamma, i);
+        l->spread[i] = lattice_spread(i);
+    }
+
+    /* Level i has 8^(depth - i) bits. All levels share one allocation. */
+    size_t bytes = 0;
+    for (int i = 0; i < depth; i++)
+        bytes += (size_t)1 << (3 * (depth - i - 1));
+    uint8_t *bits = calloc(bytes, 1);
+    for (int i = 0; i < depth; i++) {
+        l->bits[i] = bits;
+        bits += (size_t)1 << (3 * (depth - i - 1));
+    }
+    l->cells = malloc(((size_t)1 << (3 * depth)) * sizeof(l->cells[0]));
+
+    l->finder.add = method_add;
+    l->finder.remove = method_remove;
+    l->finder.nearest = method_nearest;
+    l->finder.nearest_from = method_nearest_from;
+    l->finder.nearest_k = method_nearest_k;
+    l->finder.free = method_free;
+    l->finder.slack = 1.0f;
+    return &l->finder;
+}
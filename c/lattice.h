@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include "finder.h"
+
+/* Cells take 4 bytes each, 512 MiB at depth 9. */
+#define LATTICE_MAX_DEPTH 9
+#define LATTICE_MAX_SIZE  0xffff  /* positions are packed as y << 16 | x */
+
+/* A finder for colors drawn from a colorset of the same depth and
+ * gamma. Each of the (2^depth)^3 lattice cells has one occupancy bit,
+ * and each coarser level has one bit per 2x2x2 block of the level
+ * below. All levels are ordered by Morton index, so the eight children
+ * of a block make up exactly one byte. A search walks these bytes
+ * with bit scans, and memory does not depend on the frontier size.
+ */
+typedef struct lattice {
+    finder finder;
+    int depth;
+    size_t count;
+    float *values;                        /* gamma-space value per level */
+    uint32_t *spread;                     /* level with Morton spacing */
+    uint8_t *bits[LATTICE_MAX_DEPTH];     /* bits[0] is the cells */
+    uint32_t *cells;                      /* y << 16 | x, by Morton index */
+} lattice;
+
+finder *lattice_create(int depth, float gamma);
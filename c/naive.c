@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "naive.h"
+#include "scan.h"
 
 static bool
 method_add(struct finder *f, edge e)
@@ -20,16 +21,38 @@ method_nearest(const struct finder *f, color c, edge *e)
     return naive_nearest((const naive *)f, c, e);
 }
 
+static float
+method_nearest_from(const struct finder *f, color c, edge *e)
+{
+    const naive *naive = (const struct naive *)f;
+    float best2 = INFINITY;
+    if (handles_get(naive->handles, e->x, e->y) != HANDLE_NONE)
+        best2 = color_dist2(c, e->color);
+    return sqrtf(scan_closest(naive->edges, naive->count, c, e, best2));
+}
+
+static void
+method_nearest_k(const struct finder *f, color c, nearest_set *set)
+{
+    const naive *naive = (const struct naive *)f;
+    scan_closest_k(naive->edges, naive->count, c, set);
+}
+
 static void
 method_free(const struct finder *f)
 {
     naive_free((naive *)f);
 }
 
+#if FINDER_STATIC == FINDER_NAIVE
+FINDER_STATIC_DEFINE()
+#endif
+
 finder *
-naive_create(void)
+naive_create(uint32_t width, uint32_t height)
 {
     naive *naive = malloc(sizeof(*naive));
+    naive->handles = handles_create(width, height);
     naive->max = 4096;
     naive->count = 0;
     naive->edges = malloc(naive->max * sizeof(naive->edges[0]));
@@ -37,7 +60,10 @@ naive_create(void)
     f->add = method_add;
     f->remove = method_remove;
     f->nearest = method_nearest;
+    f->nearest_from = method_nearest_from;
+    f->nearest_k = method_nearest_k;
     f->free = method_free;
+    f->slack = 1.0f;
     return f;
 }
 
@@ -45,6 +71,7 @@ void
 naive_free(const naive *naive)
 {
     free(naive->edges);
+    handles_free(naive->handles);
     free((void *)naive);
 }
 
@@ -56,6 +83,7 @@ naive_add(naive *naive, edge edge)
         naive->edges =
             realloc(naive->edges, naive->max * sizeof(naive->edges[0]));
     }
+    handles_set(naive->handles, edge.x, edge.y, naive->count);
     naive->edges[naive->count++] = edge;
     return true;
 }
@@ -63,26 +91,22 @@ naive_add(naive *naive, edge edge)
 float
 naive_nearest(const naive *naive, color target, edge *edge)
 {
-    *edge = naive->edges[0];
-    float best2 = color_dist2(edge->color, target);
-    for (size_t i = 1; i < naive->count; i++) {
-        float dist2 = color_dist2(naive->edges[i].color, target);
-        if (dist2 < best2) {
-            best2 = dist2;
-            *edge = naive->edges[i];
-        }
-    }
+    float best2 = scan_closest(naive->edges, naive->count, target, edge,
+                               INFINITY);
     return sqrtf(best2);
 }
 
 bool
 naive_remove(naive *naive, edge e)
 {
-    for (size_t i = 0; i < naive->count; i++) {
-        if ((naive->edges[i].x == e.x) && (naive->edges[i].y == e.y)) {
-            naive->edges[i] = naive->edges[--naive->count];
-            return true;
-        }
+    uint32_t i = handles_get(naive->handles, e.x, e.y);
+    if (i == HANDLE_NONE)
+        return false;
+    handles_set(naive->handles, e.x, e.y, HANDLE_NONE);
+    naive->edges[i] = naive->edges[--naive->count];
+    if (i < naive->count) {
+        edge moved = naive->edges[i];
+        handles_set(naive->handles, moved.x, moved.y, i);
     }
-    return false;
+    return true;
 }
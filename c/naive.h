@@ -1,14 +1,16 @@
 #pragma once
 
 #include "finder.h"
+#include "handles.h"
 
 typedef struct naive {
     finder finder;
     size_t count, max;
     edge *edges;
+    handles *handles;  /* index into edges */
 } naive;
 
-finder *naive_create(void);
+finder *naive_create(uint32_t width, uint32_t height);
 void    naive_free(const naive *);
 bool    naive_add(naive *, edge);
 bool    naive_remove(naive *, edge);
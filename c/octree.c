@@ -1,14 +1,19 @@
 #include <stdlib.h>
+#include <string.h>
 #include <float.h>
 #include <assert.h>
 #include "octree.h"
 #include "color.h"
+#include "scan.h"
 
 static octree *
-octree_init(octree *octree, color bound[2])
+octree_init(octree *octree, color bound[2], handles *handles,
+            octree_pool *pool)
 {
     octree->nodes = NULL;
     octree->count = 0;
+    octree->handles = handles;
+    octree->pool = pool;
     octree->bound[0] = bound[0];
     octree->bound[1] = bound[1];
     return octree;
@@ -22,6 +27,38 @@ void octree_free(const octree *octree)
     free(octree->nodes);
 }
 
+static octree *
+octree_pool_get(octree_pool *pool)
+{
+    octree *block = pool->free;
+    if (block) {
+        pool->free = block->nodes;
+        STATS_ADD(STAT_REUSE, 1);
+    } else {
+        block = malloc(sizeof(block[0]) * 8);
+        STATS_ADD(STAT_ALLOC, 1);
+    }
+    return block;
+}
+
+static void
+octree_pool_put(octree_pool *pool, octree *block)
+{
+    block->nodes = pool->free;
+    pool->free = block;
+}
+
+static void
+octree_pool_free(octree_pool *pool)
+{
+    while (pool->free) {
+        octree *block = pool->free;
+        pool->free = block->nodes;
+        free(block);
+    }
+    free(pool);
+}
+
 static bool
 octree_in_bounds(const octree *octree, color color)
 {
@@ -34,25 +71,29 @@ octree_in_bounds(const octree *octree, color color)
         color.p.b <  octree->bound[1].p.b;
 }
 
-static bool
-octree_in_radius(const octree *octree, color color, float radius)
+/* Squared distance from a color to the nearest point of the node's box.
+ * This is measured just like a real edge so that an edge lying on the
+ * box surface is never judged farther than the box itself.
+ */
+static float
+octree_box_dist2(const octree *octree, color target)
 {
-    return
-        color.p.r >= octree->bound[0].p.r - radius &&
-        color.p.r <  octree->bound[1].p.r + radius &&
-        color.p.g >= octree->bound[0].p.g - radius &&
-        color.p.g <  octree->bound[1].p.g + radius &&
-        color.p.b >= octree->bound[0].p.b - radius &&
-        color.p.b <  octree->bound[1].p.b + radius;
+    color closest = target;
+    for (int i = 0; i < 3; i++) {
+        if (closest.c[i] < octree->bound[0].c[i])
+            closest.c[i] = octree->bound[0].c[i];
+        else if (closest.c[i] > octree->bound[1].c[i])
+            closest.c[i] = octree->bound[1].c[i];
+    }
+    return color_dist2(target, closest);
 }
 
-
-
 static void
 octree_split(octree *octree)
 {
     assert(!octree->nodes);
-    octree->nodes = malloc(sizeof(octree->nodes[0]) * 8);
+    STATS_START();
+    octree->nodes = octree_pool_get(octree->pool);
     color c0 = octree->bound[0];
     color c1 = octree->bound[1];
     int i = 0;
@@ -69,7 +110,8 @@ octree_split(octree *octree)
                 bounds[1].p.r = bounds[0].p.r + hr;
                 bounds[1].p.g = bounds[0].p.g + hg;
                 bounds[1].p.b = bounds[0].p.b + hb;
-                octree_init(octree->nodes + i++, bounds);
+                octree_init(octree->nodes + i++, bounds, octree->handles,
+                            octree->pool);
             }
         }
     }
@@ -79,22 +121,29 @@ octree_split(octree *octree)
             if (octree_add(octree->nodes + n, octree->edges[i]))
                 break;
     }
+    STATS_STOP(STAT_SPLIT, 1);
 }
 
 static void
 octree_coalesce(octree *octree)
 {
     assert(octree->nodes);
-    assert(octree->count <= OCTREE_THRESHOLD);
+    assert(octree->count <= OCTREE_MERGE);
+    STATS_START();
+    /* Children coalesce first, so by now they are all leaves. */
     size_t count = 0;
     for (int i = 0; i < 8; i++) {
-        for (size_t c = 0; c < octree->nodes[i].count; c++)
-            octree->edges[count++] = octree->nodes[i].edges[c];
-        octree_free(octree->nodes + i);
+        assert(!octree->nodes[i].nodes);
+        for (size_t c = 0; c < octree->nodes[i].count; c++) {
+            edge e = octree->nodes[i].edges[c];
+            handles_set(octree->handles, e.x, e.y, count);
+            octree->edges[count++] = e;
+        }
     }
     assert(count == octree->count);
-    free(octree->nodes);
+    octree_pool_put(octree->pool, octree->nodes);
     octree->nodes = NULL;
+    STATS_STOP(STAT_COALESCE, 1);
 }
 
 bool
@@ -104,9 +153,10 @@ octree_add(octree *octree, edge edge)
         return false;
     if (!octree->nodes && octree->count == OCTREE_THRESHOLD)
         octree_split(octree);
-    if (!octree->nodes)
+    if (!octree->nodes) {
+        handles_set(octree->handles, edge.x, edge.y, octree->count);
         octree->edges[octree->count++] = edge;
-    else
+    } else
         for (size_t i = 0; i < 8; i++)
             if (octree_add(octree->nodes + i, edge)) {
                 octree->count++;
@@ -116,80 +166,143 @@ octree_add(octree *octree, edge edge)
 }
 
 static float
-octree_leaf_closest(const octree *octree, color target, edge *out)
+octree_leaf_closest(const octree *octree, color target, edge *out, float best2)
 {
     assert(!octree->nodes);
-    assert(octree->count > 0);
-    *out = octree->edges[0];
-    float best2 = color_dist2(target, out->color);
-    for (size_t i = 1; i < octree->count; i++) {
-        float dist2 = color_dist2(target, octree->edges[i].color);
-        if (dist2 < best2) {
-            best2 = dist2;
-            *out = octree->edges[i];
+    return scan_closest(octree->edges, octree->count, target, out, best2);
+}
+
+/* Pending nodes of a best-first search, keyed by box distance. */
+struct octree_queue {
+    size_t count, max;
+    struct octree_entry {
+        float dist2;
+        const octree *node;
+    } *heap, buf[64];
+};
+
+static void
+octree_queue_push(struct octree_queue *q, float dist2, const octree *node)
+{
+    if (q->count == q->max) {
+        q->max *= 2;
+        if (q->heap == q->buf) {
+            q->heap = malloc(q->max * sizeof(q->heap[0]));
+            memcpy(q->heap, q->buf, sizeof(q->buf));
+        } else {
+            q->heap = realloc(q->heap, q->max * sizeof(q->heap[0]));
         }
     }
-    assert(isfinite(best2));
-    return best2;
+    size_t i = q->count++;
+    while (i > 0 && q->heap[(i - 1) / 2].dist2 > dist2) {
+        q->heap[i] = q->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q->heap[i] = (struct octree_entry){dist2, node};
 }
 
-static float
-octree_find(const octree *octree, color target, edge *out)
+static struct octree_entry
+octree_queue_pop(struct octree_queue *q)
 {
-    if (octree->count == 0 || !octree_in_bounds(octree, target))
-        return INFINITY;
-    if (!octree->nodes) {
-        return octree_leaf_closest(octree, target, out);
-    } else {
-        float best2 = octree_find(octree->nodes + 0, target, out);
-        for (size_t i = 1; i < 8; i++) {
-            edge e;
-            float dist2 = octree_find(octree->nodes + i, target, &e);
-            if (dist2 < best2) {
-                best2 = dist2;
-                *out = e;
-            }
-        }
-        return best2;
+    struct octree_entry top = q->heap[0];
+    struct octree_entry last = q->heap[--q->count];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= q->count)
+            break;
+        if (c + 1 < q->count && q->heap[c + 1].dist2 < q->heap[c].dist2)
+            c++;
+        if (last.dist2 <= q->heap[c].dist2)
+            break;
+        q->heap[i] = q->heap[c];
+        i = c;
     }
+    q->heap[i] = last;
+    return top;
 }
 
+/* Best-first search for an edge that beats best2, or *out if none. */
 static float
-octree_nearest_radius(const octree *o, color target, edge *out, float r)
+octree_nearest_below(const octree *root, color target, edge *out,
+                     float best2)
 {
-    if (o->count == 0 || !octree_in_radius(o, target, r))
-        return INFINITY;
-    if (!o->nodes) {
-        return octree_leaf_closest(o, target, out);
-    } else {
-        float best2 = octree_nearest_radius(o->nodes + 0, target, out, r);
-        for (size_t i = 1; i < 8; i++) {
-            edge e;
-            float dist2 = octree_nearest_radius(o->nodes + i, target, &e, r);
-            if (dist2 < best2) {
-                best2 = dist2;
-                *out = e;
+    struct octree_queue q = {0, 64, NULL, {{0, NULL}}};
+    q.heap = q.buf;
+    float slack = root->finder.slack;
+
+    /* The leaf holding the target usually gives a tight first bound. */
+    const octree *home = root;
+    while (home && home->nodes) {
+        const octree *child = NULL;
+        for (size_t i = 0; i < 8 && !child; i++)
+            if (octree_in_bounds(home->nodes + i, target))
+                child = home->nodes + i;
+        home = child;
+    }
+    if (home)
+        best2 = octree_leaf_closest(home, target, out, best2);
+
+    if (root->count > 0)
+        octree_queue_push(&q, octree_box_dist2(root, target), root);
+    while (q.count > 0) {
+        struct octree_entry next = octree_queue_pop(&q);
+        /* Everything still queued is at least this far away. */
+        if (next.dist2 * slack > best2)
+            break;
+        const octree *o = next.node;
+        if (!o->nodes) {
+            if (o != home)
+                best2 = octree_leaf_closest(o, target, out, best2);
+        } else {
+            for (size_t i = 0; i < 8; i++) {
+                const octree *child = o->nodes + i;
+                if (child->count == 0)
+                    continue;
+                float dist2 = octree_box_dist2(child, target);
+                if (dist2 * slack <= best2)
+                    octree_queue_push(&q, dist2, child);
             }
         }
-        return best2;
     }
+    if (q.heap != q.buf)
+        free(q.heap);
+    return sqrtf(best2);
 }
 
 float
-octree_nearest(const octree *octree, color target, edge *out)
+octree_nearest(const octree *root, color target, edge *out)
 {
-    float worst = sqrtf(octree_find(octree, target, out));
-    if (isfinite(worst))
-        return sqrtf(octree_nearest_radius(octree, target, out, worst));
-    else {
-        float radius = 0.1;
-        do {
-            worst = sqrtf(octree_nearest_radius(octree, target, out, radius));
-            radius *= 2;
-            assert(isfinite(radius));
-        } while (!isfinite(worst));
-        return worst;
+    return octree_nearest_below(root, target, out, INFINITY);
+}
+
+void
+octree_nearest_k(const octree *root, color target, nearest_set *set)
+{
+    struct octree_queue q = {0, 64, NULL, {{0, NULL}}};
+    q.heap = q.buf;
+    if (root->count > 0)
+        octree_queue_push(&q, octree_box_dist2(root, target), root);
+    while (q.count > 0) {
+        struct octree_entry next = octree_queue_pop(&q);
+        if (next.dist2 > nearest_bound(set))
+            break;
+        const octree *o = next.node;
+        if (!o->nodes) {
+            scan_closest_k(o->edges, o->count, target, set);
+        } else {
+            for (size_t i = 0; i < 8; i++) {
+                const octree *child = o->nodes + i;
+                if (child->count == 0)
+                    continue;
+                float dist2 = octree_box_dist2(child, target);
+                if (dist2 <= nearest_bound(set))
+                    octree_queue_push(&q, dist2, child);
+            }
+        }
     }
+    if (q.heap != q.buf)
+        free(q.heap);
 }
 
 bool
@@ -198,17 +311,22 @@ octree_remove(octree *octree, edge e)
     if (!octree_in_bounds(octree, e.color))
         return false;
     if (!octree->nodes) {
-        for (size_t i = 0; i < octree->count; i++) {
-            if ((octree->edges[i].x == e.x) && (octree->edges[i].y == e.y)) {
-                octree->edges[i] = octree->edges[--octree->count];
-                return true;
-            }
-        }
+        size_t i = handles_get(octree->handles, e.x, e.y);
+        if (i >= octree->count)
+            return false;
+        edge *slot = octree->edges + i;
+        if (slot->x != e.x || slot->y != e.y)
+            return false;
+        handles_set(octree->handles, e.x, e.y, HANDLE_NONE);
+        *slot = octree->edges[--octree->count];
+        if (i < octree->count)
+            handles_set(octree->handles, slot->x, slot->y, i);
+        return true;
     } else {
         for (size_t i = 0; i < 8; i++)
             if (octree_remove(octree->nodes + i, e)) {
                 octree->count--;
-                if (octree->count <= OCTREE_THRESHOLD)
+                if (octree->count <= OCTREE_MERGE)
                     octree_coalesce(octree);
                 return true;
             }
@@ -225,7 +343,10 @@ method_add(struct finder *f, edge e)
 static bool
 method_remove(struct finder *f, edge e)
 {
-    return octree_remove((octree *)f, e);
+    octree *octree = (struct octree *)f;
+    if (handles_get(octree->handles, e.x, e.y) == HANDLE_NONE)
+        return false;
+    return octree_remove(octree, e);
 }
 
 static float
@@ -234,23 +355,51 @@ method_nearest(const struct finder *f, color c, edge *e)
     return octree_nearest((const octree *)f, c, e);
 }
 
+static float
+method_nearest_from(const struct finder *f, color c, edge *e)
+{
+    const octree *root = (const octree *)f;
+    float best2 = INFINITY;
+    if (handles_get(root->handles, e->x, e->y) != HANDLE_NONE)
+        best2 = color_dist2(c, e->color);
+    return octree_nearest_below(root, c, e, best2);
+}
+
+static void
+method_nearest_k(const struct finder *f, color c, nearest_set *set)
+{
+    octree_nearest_k((const octree *)f, c, set);
+}
+
 static void
 method_free(const struct finder *f)
 {
     octree_free((octree *)f);
+    handles_free(((octree *)f)->handles);
+    octree_pool_free(((octree *)f)->pool);
     free((struct finder *)f);
 }
 
+#if FINDER_STATIC == FINDER_OCTREE
+FINDER_STATIC_DEFINE()
+#endif
+
 finder *
-octree_create(void)
+octree_create(uint32_t width, uint32_t height)
 {
     float high = 1.0f + FLT_EPSILON;
     color bound[2] = {{{0.0f, 0.0f, 0.0f, 0.0f}}, {{high, high, high, high}}};
     struct octree *octree = malloc(sizeof(*octree));
-    finder *f = &octree_init(octree, bound)->finder;
+    handles *handles = handles_create(width, height);
+    octree_pool *pool = malloc(sizeof(*pool));
+    *pool = (octree_pool){NULL};
+    finder *f = &octree_init(octree, bound, handles, pool)->finder;
     f->add = method_add;
     f->remove = method_remove;
     f->nearest = method_nearest;
+    f->nearest_from = method_nearest_from;
+    f->nearest_k = method_nearest_k;
     f->free = method_free;
+    f->slack = 1.0f;
     return f;
 }
@@ -2,19 +2,34 @@
 
 #include "color.h"
 #include "finder.h"
+#include "handles.h"
 
 #define OCTREE_THRESHOLD 32
+/* Coalesce well below the split point so that a node hovering around
+ * the threshold doesn't split and coalesce on every other operation.
+ */
+#define OCTREE_MERGE     16
+
+/* Released blocks of 8 children, chained through their first node, to
+ * be handed out again by later splits.
+ */
+typedef struct octree_pool {
+    struct octree *free;
+} octree_pool;
 
 typedef struct octree {
     finder finder;
     color bound[2];
     struct octree *nodes;
     size_t count;
+    handles *handles;  /* position within a leaf, shared by all nodes */
+    octree_pool *pool; /* shared by all nodes */
     edge edges[OCTREE_THRESHOLD];
 } octree;
 
-finder *octree_create(void);
+finder *octree_create(uint32_t width, uint32_t height);
 void    octree_free(const octree *);
 bool    octree_add(octree *, edge);
 float   octree_nearest(const octree *, color, edge *);
+void    octree_nearest_k(const octree *, color, nearest_set *);
 bool    octree_remove(octree *, edge);
@@ -3,15 +3,104 @@
 #include <assert.h>
 #include "rand.h"
 
+static uint64_t
+rng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
 uint64_t
-xorshift(uint64_t *state)
-{
-    uint64_t x = *state;
-    x ^= x >> 12;
-    x ^= x << 25;
-    x ^= x >> 27;
-    *state = x;
-    return x * UINT64_C(2685821657736338717);
+rng_next(rng *r)
+{
+    uint64_t *s = r->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+/* Advance by the polynomial encoded in jump, as many steps as it
+ * represents.
+ */
+static void
+rng_jump(rng *r, const uint64_t jump[4])
+{
+    uint64_t s[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] >> b & 1)
+                for (int j = 0; j < 4; j++)
+                    s[j] ^= r->s[j];
+            rng_next(r);
+        }
+    }
+    for (int j = 0; j < 4; j++)
+        r->s[j] = s[j];
+}
+
+static const uint64_t rng_jump128[4] = {
+    UINT64_C(0x180ec6d33cfd0aba), UINT64_C(0xd5a61266f0c9392c),
+    UINT64_C(0xa9582618e03fc9aa), UINT64_C(0x39abdc4529b1661c)
+};
+
+static const uint64_t rng_jump192[4] = {
+    UINT64_C(0x76e15d3efefdcbbf), UINT64_C(0xc5004e441c522fb3),
+    UINT64_C(0x77710069854ee241), UINT64_C(0x39109bb02acbe635)
+};
+
+/* Expand the seed with splitmix64, which never gives an all-zero
+ * state, then long-jump once per earlier stream.
+ */
+rng
+rng_stream(uint64_t seed, enum rng_stream stream)
+{
+    rng r;
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += UINT64_C(0x9e3779b97f4a7c15));
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+        r.s[i] = z ^ (z >> 31);
+    }
+    for (int i = 0; i < (int)stream; i++)
+        rng_jump(&r, rng_jump192);
+    return r;
+}
+
+/* Return the current substream of r and move r on to the next one. */
+rng
+rng_split(rng *r)
+{
+    rng sub = *r;
+    rng_jump(r, rng_jump128);
+    return sub;
+}
+
+/* Below n, as the top of the 96-bit product of a 64-bit draw and n.
+ * Using every bit of the draw keeps the bias under n / 2^64.
+ */
+uint32_t
+rng_below(rng *r, uint32_t n)
+{
+    uint64_t x = rng_next(r);
+    uint64_t hi = (x >> 32) * n;
+    uint64_t lo = (x & UINT64_C(0xffffffff)) * n;
+    return (hi + (lo >> 32)) >> 32;
+}
+
+/* Indices for n steps of a Fisher-Yates shuffle of top elements from
+ * the end: out[i] is below top - i.
+ */
+void
+rng_fill(rng *r, uint32_t *out, size_t n, uint32_t top)
+{
+    assert(n <= top);
+    for (size_t i = 0; i < n; i++)
+        out[i] = rng_below(r, top - i);
 }
 
 uint64_t
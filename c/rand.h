@@ -1,4 +1,26 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* xoshiro256** (Blackman and Vigna). A seed is split into streams by
+ * jumping ahead: 2^192 steps between the top-level streams below and
+ * 2^128 steps between the substreams handed out by rng_split(). No two
+ * will ever overlap in practice, and each depends only on the seed and
+ * its position, never on how many threads share the work.
+ */
+typedef struct rng {
+    uint64_t s[4];
+} rng;
+
+enum rng_stream {
+    RNG_SHUFFLE,  /* color order */
+    RNG_PLACE     /* neighbor choice, and tiles split from it */
+};
+
 uint64_t seedgen(void);
-uint64_t xorshift(uint64_t *state);
+rng      rng_stream(uint64_t seed, enum rng_stream);
+rng      rng_split(rng *);
+uint64_t rng_next(rng *);
+uint32_t rng_below(rng *, uint32_t n);
+void     rng_fill(rng *, uint32_t *out, size_t n, uint32_t top);
@@ -0,0 +1,229 @@
+#include <string.h>
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define SCAN_X86 1
+#  include <immintrin.h>
+#endif
+
+/* Distances are computed a chunk at a time into a small buffer, which
+ * is then searched for the winner. Most chunks lose outright.
+ */
+#define SCAN_CHUNK 64
+
+typedef float (*scan_fn)(const edge *, size_t, color, float *);
+
+/* Each kernel stores every squared distance in out and returns the
+ * smallest. The sums are ordered (r + g) + b, matching color_dist2().
+ */
+static float
+scan_dist2_scalar(const edge *e, size_t n, color target, float *out)
+{
+    float min = INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = color_dist2(target, e[i].color);
+        if (out[i] < min)
+            min = out[i];
+    }
+    return min;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static float
+scan_dist2_sse2(const edge *e, size_t n, color target, float *out)
+{
+    __m128 t = _mm_loadu_ps(target.c);
+    __m128 min = _mm_set1_ps(INFINITY);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 a0 = _mm_sub_ps(t, _mm_loadu_ps(e[i + 0].color.c));
+        __m128 a1 = _mm_sub_ps(t, _mm_loadu_ps(e[i + 1].color.c));
+        __m128 a2 = _mm_sub_ps(t, _mm_loadu_ps(e[i + 2].color.c));
+        __m128 a3 = _mm_sub_ps(t, _mm_loadu_ps(e[i + 3].color.c));
+        a0 = _mm_mul_ps(a0, a0);
+        a1 = _mm_mul_ps(a1, a1);
+        a2 = _mm_mul_ps(a2, a2);
+        a3 = _mm_mul_ps(a3, a3);
+        _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+        __m128 d = _mm_add_ps(_mm_add_ps(a0, a1), a2);
+        _mm_storeu_ps(out + i, d);
+        min = _mm_min_ps(min, d);
+    }
+    min = _mm_min_ps(min, _mm_shuffle_ps(min, min, _MM_SHUFFLE(1, 0, 3, 2)));
+    min = _mm_min_ps(min, _mm_shuffle_ps(min, min, _MM_SHUFFLE(2, 3, 0, 1)));
+    float tail = scan_dist2_scalar(e + i, n - i, target, out + i);
+    float head = _mm_cvtss_f32(min);
+    return tail < head ? tail : head;
+}
+
+__attribute__((target("avx2")))
+static float
+scan_dist2_avx2(const edge *e, size_t n, color target, float *out)
+{
+    __m256 t = _mm256_broadcast_ps((const __m128 *)target.c);
+    __m256 min = _mm256_set1_ps(INFINITY);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        /* Lanes hold edges i..i+3 low and i+4..i+7 high. */
+        __m256 a[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 lo = _mm_loadu_ps(e[i + j].color.c);
+            __m128 hi = _mm_loadu_ps(e[i + j + 4].color.c);
+            __m256 v = _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+            v = _mm256_sub_ps(t, v);
+            a[j] = _mm256_mul_ps(v, v);
+        }
+        __m256 t0 = _mm256_unpacklo_ps(a[0], a[1]);
+        __m256 t1 = _mm256_unpacklo_ps(a[2], a[3]);
+        __m256 t2 = _mm256_unpackhi_ps(a[0], a[1]);
+        __m256 t3 = _mm256_unpackhi_ps(a[2], a[3]);
+        __m256 r = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 g = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 b = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 d = _mm256_add_ps(_mm256_add_ps(r, g), b);
+        _mm256_storeu_ps(out + i, d);
+        min = _mm256_min_ps(min, d);
+    }
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(min),
+                          _mm256_extractf128_ps(min, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    float tail = scan_dist2_scalar(e + i, n - i, target, out + i);
+    float head = _mm_cvtss_f32(m);
+    return tail < head ? tail : head;
+}
+
+__attribute__((target("avx512f")))
+static float
+scan_dist2_avx512(const edge *e, size_t n, color target, float *out)
+{
+    __m512 t = _mm512_broadcast_f32x4(_mm_loadu_ps(target.c));
+    __m512 min = _mm512_set1_ps(INFINITY);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        /* 128-bit lane k holds edges i+4k..i+4k+3. */
+        __m512 a[4];
+        for (int j = 0; j < 4; j++) {
+            __m512 v = _mm512_castps128_ps512(_mm_loadu_ps(e[i + j].color.c));
+            v = _mm512_insertf32x4(v, _mm_loadu_ps(e[i + j + 4].color.c), 1);
+            v = _mm512_insertf32x4(v, _mm_loadu_ps(e[i + j + 8].color.c), 2);
+            v = _mm512_insertf32x4(v, _mm_loadu_ps(e[i + j + 12].color.c), 3);
+            v = _mm512_sub_ps(t, v);
+            a[j] = _mm512_mul_ps(v, v);
+        }
+        __m512 t0 = _mm512_unpacklo_ps(a[0], a[1]);
+        __m512 t1 = _mm512_unpacklo_ps(a[2], a[3]);
+        __m512 t2 = _mm512_unpackhi_ps(a[0], a[1]);
+        __m512 t3 = _mm512_unpackhi_ps(a[2], a[3]);
+        __m512 r = _mm512_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+        __m512 g = _mm512_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+        __m512 b = _mm512_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m512 d = _mm512_add_ps(_mm512_add_ps(r, g), b);
+        _mm512_storeu_ps(out + i, d);
+        min = _mm512_min_ps(min, d);
+    }
+    float tail = scan_dist2_scalar(e + i, n - i, target, out + i);
+    float head = _mm512_reduce_min_ps(min);
+    return tail < head ? tail : head;
+}
+#endif
+
+static const struct {
+    const char *name;
+    const char *feature;
+    scan_fn fn;
+} kernels[] = {
+#ifdef SCAN_X86
+    {"avx512", "avx512f", scan_dist2_avx512},
+    {"avx2",   "avx2",    scan_dist2_avx2},
+    {"sse2",   "sse2",    scan_dist2_sse2},
+#endif
+    {"scalar", 0,         scan_dist2_scalar},
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static size_t kernel = KERNELS - 1;
+
+static bool
+scan_supported(size_t i)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (kernels[i].feature) {
+        /* __builtin_cpu_supports() only takes string literals. */
+        if (!strcmp(kernels[i].feature, "avx512f"))
+            return __builtin_cpu_supports("avx512f");
+        if (!strcmp(kernels[i].feature, "avx2"))
+            return __builtin_cpu_supports("avx2");
+        if (!strcmp(kernels[i].feature, "sse2"))
+            return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return !kernels[i].feature;
+}
+
+/* Pick the widest kernel before any thread can call scan_closest(). */
+__attribute__((constructor))
+static void
+scan_init(void)
+{
+    for (kernel = 0; !scan_supported(kernel); kernel++);
+}
+
+const char *
+scan_kernel(void)
+{
+    return kernels[kernel].name;
+}
+
+bool
+scan_select(const char *name)
+{
+    for (size_t i = 0; i < KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name) && scan_supported(i)) {
+            kernel = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+float
+scan_closest(const edge *e, size_t n, color target, edge *best, float best2)
+{
+    float dist2[SCAN_CHUNK];
+    scan_fn fn = kernels[kernel].fn;
+    STATS_ADD(STAT_SCANNED, n);
+    for (size_t base = 0; base < n; base += SCAN_CHUNK) {
+        size_t len = n - base < SCAN_CHUNK ? n - base : SCAN_CHUNK;
+        float min = fn(e + base, len, target, dist2);
+        if (min > best2)
+            continue;
+        for (size_t i = 0; i < len; i++) {
+            if (dist2[i] == min &&
+                edge_closer(min, e[base + i], best2, *best)) {
+                best2 = min;
+                *best = e[base + i];
+            }
+        }
+    }
+    return best2;
+}
+
+void
+scan_closest_k(const edge *e, size_t n, color target, nearest_set *set)
+{
+    float dist2[SCAN_CHUNK];
+    scan_fn fn = kernels[kernel].fn;
+    STATS_ADD(STAT_SCANNED, n);
+    for (size_t base = 0; base < n; base += SCAN_CHUNK) {
+        size_t len = n - base < SCAN_CHUNK ? n - base : SCAN_CHUNK;
+        if (fn(e + base, len, target, dist2) > nearest_bound(set))
+            continue;
+        for (size_t i = 0; i < len; i++)
+            if (dist2[i] <= nearest_bound(set))
+                nearest_insert(set, dist2[i], e[base + i]);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include "finder.h"
+
+/* Scan a block of edges for the one closest to target. If any edge
+ * beats the current best, as judged by edge_closer(), it is stored in
+ * *best and its squared distance is returned. Otherwise best2 is
+ * returned unchanged.
+ *
+ * The distance kernel is chosen at startup to match the CPU (AVX-512,
+ * AVX2, SSE2 or plain C). Every kernel rounds exactly like
+ * color_dist2(), so all of them pick the same edge.
+ */
+float scan_closest(const edge *, size_t n, color target,
+                   edge *best, float best2);
+
+/* Offer every edge of a block to a nearest set. */
+void scan_closest_k(const edge *, size_t n, color target, nearest_set *);
+
+/* Name of the kernel in use. */
+const char *scan_kernel(void);
+
+/* Force a particular kernel by name, returning false if unsupported. */
+bool scan_select(const char *name);
@@ -0,0 +1,207 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "spec.h"
+
+/* Colors speculated per thread in each batch. Larger batches amortize
+ * synchronization, but every answer must be checked against every edge
+ * added earlier in the same batch.
+ */
+#define SPEC_BATCH 16
+
+struct spec_worker {
+    pthread_t thread;
+    struct spec *spec;
+    int id;
+};
+
+struct spec {
+    int threads;
+    size_t batch;
+    size_t count, next;
+    edge *answers;  /* in memory order of the batch's colors */
+    bool *found;
+    edge *added, *removed;
+    size_t nadded, nremoved, maxremoved;
+
+    /* Current batch, shared with the workers */
+    finder *finder;
+    color *colors;  /* the batch, in memory order of the colorset */
+    struct spec_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    unsigned long generation;
+    int busy;
+    bool quit;
+};
+
+/* Each thread looks up one contiguous run of the batch with a single
+ * finder_nearest_many() call. Colors pop from the end of the colorset, so
+ * lookup i is at memory position count - 1 - i.
+ */
+static void
+spec_run(spec *s, int id)
+{
+    size_t per = (s->count + s->threads - 1) / s->threads;
+    size_t lo = id * per;
+    size_t hi = lo + per < s->count ? lo + per : s->count;
+    if (lo >= hi)
+        return;
+    size_t j = s->count - hi;
+    size_t n = hi - lo;
+    bool found =
+        finder_nearest_many(s->finder, s->colors + j, n, s->answers + j) == n;
+    for (size_t i = 0; i < n; i++)
+        s->found[j + i] = found;
+}
+
+static void *
+spec_worker(void *arg)
+{
+    struct spec_worker *w = arg;
+    spec *s = w->spec;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && s->generation == seen)
+            pthread_cond_wait(&s->wake, &s->lock);
+        if (s->quit)
+            break;
+        seen = s->generation;
+        pthread_mutex_unlock(&s->lock);
+        spec_run(s, w->id);
+        pthread_mutex_lock(&s->lock);
+        if (--s->busy == 0)
+            pthread_cond_signal(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+spec *
+spec_create(int threads)
+{
+    spec *s = malloc(sizeof(*s));
+    s->threads = threads;
+    s->batch = (size_t)threads * SPEC_BATCH;
+    s->count = s->next = 0;
+    s->colors = malloc(s->batch * sizeof(s->colors[0]));
+    s->answers = malloc(s->batch * sizeof(s->answers[0]));
+    s->found = malloc(s->batch * sizeof(s->found[0]));
+    s->added = malloc(s->batch * sizeof(s->added[0]));
+    s->maxremoved = s->batch;
+    s->removed = malloc(s->maxremoved * sizeof(s->removed[0]));
+    s->nadded = s->nremoved = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    pthread_cond_init(&s->done, NULL);
+    s->generation = 0;
+    s->busy = 0;
+    s->quit = false;
+    /* The calling thread doubles as worker 0. */
+    s->workers = malloc(threads * sizeof(s->workers[0]));
+    for (int i = 1; i < threads; i++) {
+        s->workers[i].spec = s;
+        s->workers[i].id = i;
+        pthread_create(&s->workers[i].thread, NULL, spec_worker,
+                       s->workers + i);
+    }
+    return s;
+}
+
+void
+spec_free(spec *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->quit = true;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 1; i < s->threads; i++)
+        pthread_join(s->workers[i].thread, NULL);
+    pthread_cond_destroy(&s->done);
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    free(s->workers);
+    free(s->removed);
+    free(s->added);
+    free(s->colors);
+    free(s->answers);
+    free(s->found);
+    free(s);
+}
+
+/* Look up the next batch, starting with the color just popped. */
+static void
+spec_refill(spec *s, finder *f, const colorset *set)
+{
+    s->finder = f;
+    s->count = set->count + 1 < s->batch ? set->count + 1 : s->batch;
+    /* The color just popped sits one past the end of the set. */
+    for (size_t i = 0; i < s->count; i++)
+        s->colors[s->count - 1 - i] =
+            colorset_color(set, colorset_at(set, set->count - i));
+    s->next = 0;
+    s->nadded = s->nremoved = 0;
+    pthread_mutex_lock(&s->lock);
+    s->generation++;
+    s->busy = s->threads - 1;
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    spec_run(s, 0);
+    pthread_mutex_lock(&s->lock);
+    while (s->busy > 0)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+bool
+spec_nearest(spec *s, finder *f, const colorset *set, color c, edge *e)
+{
+    if (s->next == s->count)
+        spec_refill(s, f, set);
+    size_t j = s->count - 1 - s->next++;
+    assert(s->colors[j].p.r == c.p.r && s->colors[j].p.g == c.p.g &&
+           s->colors[j].p.b == c.p.b);
+    if (!s->found[j])
+        return false;
+    edge best = s->answers[j];
+    for (size_t i = 0; i < s->nremoved; i++)
+        if (s->removed[i].x == best.x && s->removed[i].y == best.y)
+            return false;
+    /* The frontier only differs from the snapshot by what was added. */
+    float best2 = color_dist2(c, best.color);
+    for (size_t i = 0; i < s->nadded; i++) {
+        float dist2 = color_dist2(c, s->added[i].color);
+        if (edge_closer(dist2, s->added[i], best2, best)) {
+            best2 = dist2;
+            best = s->added[i];
+        }
+    }
+    *e = best;
+    return true;
+}
+
+void
+spec_added(spec *s, edge e)
+{
+    assert(s->nadded < s->batch);
+    s->added[s->nadded++] = e;
+}
+
+void
+spec_removed(spec *s, edge e)
+{
+    for (size_t i = 0; i < s->nadded; i++) {
+        if (s->added[i].x == e.x && s->added[i].y == e.y) {
+            s->added[i] = s->added[--s->nadded];
+            return;
+        }
+    }
+    if (s->nremoved == s->maxremoved) {
+        s->maxremoved *= 2;
+        s->removed =
+            realloc(s->removed, s->maxremoved * sizeof(s->removed[0]));
+    }
+    s->removed[s->nremoved++] = e;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include "finder.h"
+#include "colorset.h"
+
+/* Speculative nearest-edge lookups for upcoming colors. A batch of
+ * queries runs in parallel against the frontier as it stood when the
+ * batch started. Each answer is then checked against the edges added
+ * and removed since, so it always matches what a serial lookup would
+ * have returned at that point.
+ */
+typedef struct spec spec;
+
+spec *spec_create(int threads);
+void  spec_free(spec *);
+bool  spec_nearest(spec *, finder *, const colorset *, color, edge *);
+void  spec_added(spec *, edge);
+void  spec_removed(spec *, edge);
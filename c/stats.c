@@ -0,0 +1,53 @@
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#include "stats.h"
+
+#ifdef STATS
+uint64_t stats_count[STAT_COUNT];
+uint64_t stats_ns[STAT_COUNT];
+
+uint64_t
+stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+double
+stats_seconds(void)
+{
+    static struct timespec start;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (!start.tv_sec && !start.tv_nsec)
+        start = ts;
+    return (ts.tv_sec - start.tv_sec) + (ts.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void
+stats_write(FILE *out, double seconds, size_t remaining,
+            size_t placed, size_t retries)
+{
+    fprintf(out, "{\"seconds\": %.6f, \"remaining\": %zu, "
+            "\"placed\": %zu, \"retries\": %zu",
+            seconds, remaining, placed, retries);
+#ifdef STATS
+    static const char names[STAT_COUNT][10] = {
+        "nearest", "add", "remove", "split", "coalesce",
+        "rebuild", "scanned", "retry", "frame", "alloc", "reuse"
+    };
+    fputs(", \"counters\": {", out);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        uint64_t count = __atomic_load_n(stats_count + i, __ATOMIC_RELAXED);
+        uint64_t ns = __atomic_load_n(stats_ns + i, __ATOMIC_RELAXED);
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"ns\": %llu}",
+                i ? ", " : "", names[i],
+                (unsigned long long)count, (unsigned long long)ns);
+    }
+    fputc('}', out);
+#endif
+    fputs("}\n", out);
+    fflush(out);
+}
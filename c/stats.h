@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Hot-path counters and timers, built only with -DSTATS
+ * (make clean && make STATS=-DSTATS) and otherwise compiled out.
+ * Updates are relaxed atomics so speculative and tile threads can share
+ * them.
+ */
+enum stat {
+    STAT_NEAREST,   /* nearest(), nearest_k() and batched queries */
+    STAT_ADD,
+    STAT_REMOVE,
+    STAT_SPLIT,     /* leaves split into children */
+    STAT_COALESCE,  /* subtrees merged back into a leaf */
+    STAT_REBUILD,   /* scapegoat subtree rebuilds */
+    STAT_SCANNED,   /* leaf edges compared against a query */
+    STAT_RETRY,     /* dead edges returned by a lookup */
+    STAT_FRAME,     /* images or delta frames written */
+    STAT_ALLOC,     /* node blocks taken from malloc() */
+    STAT_REUSE,     /* node blocks taken from a free list */
+    STAT_COUNT
+};
+
+#ifdef STATS
+extern uint64_t stats_count[STAT_COUNT];
+extern uint64_t stats_ns[STAT_COUNT];
+uint64_t stats_now(void);
+
+#define STATS_ADD(s, n) \
+    __atomic_fetch_add(stats_count + (s), (n), __ATOMIC_RELAXED)
+#define STATS_START() \
+    uint64_t stats_start_ = stats_now()
+#define STATS_STOP(s, n) \
+    do { \
+        __atomic_fetch_add(stats_ns + (s), stats_now() - stats_start_, \
+                           __ATOMIC_RELAXED); \
+        STATS_ADD(s, n); \
+    } while (0)
+#else
+#define STATS_ADD(s, n)  ((void)0)
+#define STATS_START()    ((void)0)
+#define STATS_STOP(s, n) ((void)0)
+#endif
+
+/* Wall-clock seconds since the first call. */
+double stats_seconds(void);
+
+/* Write one sample as a single line of JSON. Counters are included
+ * only when they were compiled in.
+ */
+void stats_write(FILE *out, double seconds, size_t remaining,
+                 size_t placed, size_t retries);
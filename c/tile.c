@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "tile.h"
+#include "rand.h"
+
+struct tile_job {
+    const tiling *tiling;
+    grow *canvas;
+    rng *rngs;
+    size_t *firsts;      /* colorset position of each tile's colors */
+    size_t *counts;      /* colors given to each tile */
+    pthread_mutex_t lock;
+    int next;            /* next tile to claim */
+};
+
+/* Part i of n along a side of the given size is [lo, hi), less the
+ * gutter before it.
+ */
+static void
+tile_span(uint32_t size, int n, int i, uint32_t *lo, uint32_t *hi)
+{
+    *lo = (uint64_t)size * i / n + (i > 0);
+    *hi = (uint64_t)size * (i + 1) / n;
+}
+
+/* Tile i covers [x0, x1) x [y0, y1). */
+static void
+tile_bounds(const tiling *t, const image *im, int i,
+            uint32_t *x0, uint32_t *y0, uint32_t *x1, uint32_t *y1)
+{
+    tile_span(im->width, t->cols, i % t->cols, x0, x1);
+    tile_span(im->height, t->rows, i / t->cols, y0, y1);
+}
+
+bool
+tile_fits(int cols, int rows, uint32_t width, uint32_t height)
+{
+    if (cols < 1 || rows < 1)
+        return false;
+    uint32_t lo, hi;
+    for (int i = 0; i < cols; i++) {
+        tile_span(width, cols, i, &lo, &hi);
+        if (hi < lo + 2)
+            return false;
+    }
+    for (int i = 0; i < rows; i++) {
+        tile_span(height, rows, i, &lo, &hi);
+        if (hi < lo + 2)
+            return false;
+    }
+    return true;
+}
+
+static void
+tile_run(struct tile_job *job, int i)
+{
+    const tiling *t = job->tiling;
+    grow *canvas = job->canvas;
+    uint32_t x0, y0, x1, y1;
+    tile_bounds(t, canvas->image, i, &x0, &y0, &x1, &y1);
+    uint32_t w = x1 - x0;
+    uint32_t h = y1 - y0;
+
+    image *im = image_create(w, h, canvas->image->depth, t->gamma);
+    colorset *set = colorset_slice(canvas->colorset,
+                                   job->firsts[i], job->counts[i]);
+    finder *f = t->create(t->ctx, w, h);
+    grow g;
+    grow_init(&g, im, set, f, job->rngs + i);
+    if (t->prune)
+        grow_prune(&g);
+
+    int starts = 0;
+    for (int s = 0; s < t->nstarts; s++) {
+        uint32_t x = t->starts[s].x;
+        uint32_t y = t->starts[s].y;
+        if (x >= x0 && x < x1 && y >= y0 && y < y1 &&
+            !image_occupied(im, x - x0, y - y0) && !grow_done(&g)) {
+            grow_start(&g, x - x0, y - y0);
+            starts++;
+        }
+    }
+    if (!starts && !grow_done(&g))
+        grow_start(&g, w / 2, h / 2);
+    while (!grow_done(&g))
+        grow_step(&g);
+
+    /* Tiles never overlap, but they share occupancy words. */
+    pthread_mutex_lock(&job->lock);
+    for (uint32_t y = 0; y < h; y++)
+        for (uint32_t x = 0; x < w; x++)
+            if (image_occupied(im, x, y))
+                image_set(canvas->image, x0 + x, y0 + y, image_get(im, x, y));
+    canvas->placed += g.placed;
+    canvas->retries += g.retries;
+    canvas->pixels_left -= g.placed;
+    if (t->verbose)
+        fprintf(stderr, "tile %d done, %zu pixels remaining\n",
+                i, canvas->pixels_left);
+    pthread_mutex_unlock(&job->lock);
+
+    free(g.free);
+    finder_free(f);
+    colorset_free(set);
+    image_free(im);
+}
+
+static void *
+tile_worker(void *arg)
+{
+    struct tile_job *job = arg;
+    int ntiles = job->tiling->cols * job->tiling->rows;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= ntiles)
+            break;
+        tile_run(job, i);
+    }
+    return NULL;
+}
+
+void
+tile_grow(grow *g, const tiling *t)
+{
+    int ntiles = t->cols * t->rows;
+    struct tile_job job = {
+        .tiling = t,
+        .canvas = g,
+        .rngs = malloc(ntiles * sizeof(job.rngs[0])),
+        .firsts = malloc(ntiles * sizeof(job.firsts[0])),
+        .counts = malloc(ntiles * sizeof(job.counts[0])),
+        .next = 0,
+    };
+
+    /* Hand out colors from the top of the set in tile order, one per
+     * interior pixel. The gutters get whatever is left at the bottom.
+     */
+    size_t top = g->colorset->count;
+    for (int i = 0; i < ntiles; i++) {
+        uint32_t x0, y0, x1, y1;
+        tile_bounds(t, g->image, i, &x0, &y0, &x1, &y1);
+        size_t pixels = (size_t)(x1 - x0) * (y1 - y0);
+        job.counts[i] = pixels < top ? pixels : top;
+        top -= job.counts[i];
+        job.firsts[i] = top;
+        job.rngs[i] = rng_split(&g->rng);
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    int threads = t->threads < ntiles ? t->threads : ntiles;
+    pthread_t *workers = malloc(threads * sizeof(workers[0]));
+    for (int i = 1; i < threads; i++)
+        pthread_create(workers + i, NULL, tile_worker, &job);
+    tile_worker(&job);
+    for (int i = 1; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    g->colorset->count = top;
+
+    const image *im = g->image;
+    for (uint32_t y = 0; y < im->height; y++)
+        for (uint32_t x = 0; x < im->width; x++)
+            if (image_frontier(im, x, y))
+                finder_add(g->finder, (edge){x, y, image_get(im, x, y)});
+
+    free(workers);
+    free(job.counts);
+    free(job.firsts);
+    free(job.rngs);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include "grow.h"
+
+#define TILE_MAX_STARTS 128
+
+/* Growth split into a grid of tiles for very large canvases. Each tile
+ * is grown on its own image, with its own finder, random substream and
+ * slice of the colorset, and tiles run in parallel. Tiles are separated by
+ * one-pixel gutters which are left for the caller to fill serially
+ * with the remaining colors, reconciling the seams. The result depends
+ * on the grid and the seed, but not on the number of threads. Frames
+ * cannot be taken until every tile is done.
+ */
+typedef struct tiling {
+    int cols, rows;
+    int threads;
+    float gamma;
+    bool prune;    /* prune surrounded edges eagerly within tiles */
+    bool verbose;  /* report each finished tile on stderr */
+    finder *(*create)(void *ctx, uint32_t width, uint32_t height);
+    void *ctx;
+    int nstarts;   /* start points in canvas coordinates */
+    struct {
+        uint32_t x, y;
+    } starts[TILE_MAX_STARTS];
+} tiling;
+
+/* True if a cols x rows grid leaves every tile of the canvas at least
+ * two pixels across in each direction.
+ */
+bool tile_fits(int cols, int rows, uint32_t width, uint32_t height);
+
+/* Grow every tile into g's image, leaving the gutters free and g's
+ * finder holding every placed pixel that borders one.
+ */
+void tile_grow(grow *g, const tiling *t);
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "delta.h"
+
+/* Rebuild full 8-bit P6 frames from a delta stream, e.g. for piping into
+ * ffmpeg -f image2pipe -c:v ppm -i - out.y4m
+ */
+static void
+fail(const char *name, const char *message)
+{
+    fprintf(stderr, "%s: %s\n", name, message);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    FILE *out = stdout;
+    if (argc > 3 || (argc > 1 && argv[1][0] == '-' && argv[1][1])) {
+        fprintf(stderr, "Usage: %s [input [output]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc > 1 && strcmp(argv[1], "-") != 0 &&
+        !(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (argc > 2 && strcmp(argv[2], "-") != 0 &&
+        !(out = fopen(argv[2], "wb"))) {
+        perror(argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t header[12];
+    if (!fread(header, sizeof(header), 1, in) ||
+        memcmp(header, DELTA_MAGIC, 4) != 0)
+        fail(argv[0], "not a delta stream");
+    uint32_t width = delta_get32(header + 4);
+    uint32_t height = delta_get32(header + 8);
+    size_t pixels = (size_t)width * height;
+    uint8_t *frame = calloc(pixels, 3);
+
+    uint8_t count[4];
+    uint8_t record[DELTA_RECORD];
+    while (fread(count, sizeof(count), 1, in)) {
+        for (uint32_t n = delta_get32(count); n > 0; n--) {
+            if (!fread(record, sizeof(record), 1, in))
+                fail(argv[0], "truncated frame");
+            uint32_t i = delta_get32(record);
+            if (i >= pixels)
+                fail(argv[0], "pixel out of range");
+            memcpy(frame + i * (size_t)3, record + 4, 3);
+        }
+        fprintf(out, "P6\n%" PRIu32 " %" PRIu32 "\n255\n", width, height);
+        fwrite(frame, pixels, 3, out);
+    }
+    if (ferror(in))
+        fail(argv[0], "read error");
+    free(frame);
+    return fflush(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}